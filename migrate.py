@@ -0,0 +1,142 @@
+# Converts a client database between the rows and blobs storage backends
+# (DB_STORAGE in config.h, or --storage=NAME). Back up first.
+#
+#   python migrate.py craft.db          rows to blobs
+#   python migrate.py craft.db rows     blobs to rows
+
+import sqlite3
+import sys
+
+CHUNK_SIZE = 32
+BLOB_VERSION = 1
+TABLES = ['block', 'light']
+
+def key(p, q, x, y, z):
+    x -= p * CHUNK_SIZE - 1
+    z -= q * CHUNK_SIZE - 1
+    return ((y & 0xff) << 16) | ((z & 0xff) << 8) | (x & 0xff)
+
+def position(p, q, k):
+    x = (k & 0xff) + p * CHUNK_SIZE - 1
+    y = (k >> 16) & 0xff
+    z = ((k >> 8) & 0xff) + q * CHUNK_SIZE - 1
+    return x, y, z
+
+def put_varint(data, value):
+    while value >= 0x80:
+        data.append((value & 0x7f) | 0x80)
+        value >>= 7
+    data.append(value)
+
+def get_varint(data, offset):
+    result = 0
+    shift = 0
+    while True:
+        c = data[offset]
+        offset += 1
+        result |= (c & 0x7f) << shift
+        if not c & 0x80:
+            return result, offset
+        shift += 7
+
+def encode(voxels):
+    voxels = sorted(voxels)
+    data = bytearray([BLOB_VERSION])
+    end = 0
+    i = 0
+    while i < len(voxels):
+        k, w = voxels[i]
+        run = 1
+        while (i + run < len(voxels) and
+            voxels[i + run] == (k + run, w)):
+            run += 1
+        put_varint(data, k - end)
+        put_varint(data, run - 1)
+        put_varint(data, ((w << 1) ^ (w >> 31)) & 0xffffffff)
+        end = k + run
+        i += run
+    return bytes(data)
+
+def decode(data):
+    data = bytearray(data)
+    if not data or data[0] != BLOB_VERSION:
+        return []
+    result = []
+    offset = 1
+    end = 0
+    while offset < len(data):
+        gap, offset = get_varint(data, offset)
+        run, offset = get_varint(data, offset)
+        zigzag, offset = get_varint(data, offset)
+        w = (zigzag >> 1) ^ -(zigzag & 1)
+        k = end + gap
+        for i in range(run + 1):
+            result.append((k + i, w))
+        end = k + run + 1
+    return result
+
+def create(conn):
+    for table in TABLES:
+        conn.execute(
+            'create table if not exists %s_blob ('
+            '    p int not null,'
+            '    q int not null,'
+            '    data blob not null'
+            ');' % table)
+        conn.execute(
+            'create unique index if not exists %s_blob_pq_idx '
+            'on %s_blob (p, q);' % (table, table))
+
+def to_blobs(conn):
+    create(conn)
+    for table in TABLES:
+        chunks = {}
+        query = 'select p, q, x, y, z, w from %s;' % table
+        for p, q, x, y, z, w in conn.execute(query):
+            chunks.setdefault((p, q), {})[key(p, q, x, y, z)] = w
+        query = 'select p, q, data from %s_blob;' % table
+        for p, q, data in conn.execute(query):
+            voxels = chunks.setdefault((p, q), {})
+            for k, w in decode(data):
+                voxels.setdefault(k, w)
+        query = (
+            'insert or replace into %s_blob (p, q, data) '
+            'values (?, ?, ?);' % table)
+        for (p, q), voxels in chunks.items():
+            data = encode(voxels.items())
+            conn.execute(query, (p, q, sqlite3.Binary(data)))
+        conn.execute('delete from %s;' % table)
+        print('%s: %d chunks' % (table, len(chunks)))
+
+def to_rows(conn):
+    create(conn)
+    for table in TABLES:
+        query = 'select p, q, data from %s_blob;' % table
+        rows = []
+        for p, q, data in conn.execute(query):
+            for k, w in decode(data):
+                x, y, z = position(p, q, k)
+                rows.append((p, q, x, y, z, w))
+        query = (
+            'insert or replace into %s (p, q, x, y, z, w) '
+            'values (?, ?, ?, ?, ?, ?);' % table)
+        conn.executemany(query, rows)
+        conn.execute('delete from %s_blob;' % table)
+        print('%s: %d rows' % (table, len(rows)))
+
+def main():
+    args = sys.argv[1:]
+    if len(args) not in (1, 2) or args[1:] not in ([], ['rows']):
+        print('usage: python migrate.py path [rows]')
+        return
+    conn = sqlite3.connect(args[0])
+    if args[1:] == ['rows']:
+        to_rows(conn)
+    else:
+        to_blobs(conn)
+    conn.commit()
+    conn.execute('vacuum;')
+    conn.close()
+
+if __name__ == '__main__':
+    main()
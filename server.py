@@ -7,10 +7,12 @@ import random
 import re
 import requests
 import sqlite3
+import struct
 import sys
 import threading
 import time
 import traceback
+import zlib
 
 DEFAULT_HOST = '0.0.0.0'
 DEFAULT_PORT = 4080
@@ -20,6 +22,8 @@ LOG_PATH = 'log.txt'
 
 CHUNK_SIZE = 32
 BUFFER_SIZE = 4096
+FRAME_BLOCKS = 4096
+COMPRESS_SIZE = 512
 COMMIT_INTERVAL = 5
 
 AUTH_REQUIRED = True
@@ -51,6 +55,9 @@ TIME = 'E'
 VERSION = 'V'
 YOU = 'U'
 
+TEXT_FRAME = '\x00'
+COMPRESSED = 'Z'
+
 try:
     from config import *
 except ImportError:
@@ -69,6 +76,70 @@ def chunked(x):
 def packet(*args):
     return '%s\n' % ','.join(map(str, args))
 
+def varint(value):
+    data = []
+    while value >= 0x80:
+        data.append(chr(value & 0x7f | 0x80))
+        value >>= 7
+    data.append(chr(value))
+    return ''.join(data)
+
+def zigzag(value):
+    return varint(value << 1 if value >= 0 else (~value << 1) | 1)
+
+def frame(kind, payload):
+    # protocol 2: the length, a kind byte and the payload
+    return '%s%s%s' % (varint(len(payload) + 1), kind, payload)
+
+def block_frames(kind, p, q, rows):
+    # blocks or lights as x, y, z, w relative to the chunk
+    x0, z0 = p * CHUNK_SIZE, q * CHUNK_SIZE
+    frames = []
+    for i in xrange(0, len(rows), FRAME_BLOCKS):
+        batch = rows[i:i + FRAME_BLOCKS]
+        data = [zigzag(p), zigzag(q), varint(len(batch))]
+        for x, y, z, w in batch:
+            data.append(zigzag(x - x0) + zigzag(y) +
+                zigzag(z - z0) + zigzag(w))
+        frames.append(frame(kind, ''.join(data)))
+    return ''.join(frames)
+
+def encode(version, *args):
+    # a packet in the protocol the client asked for, commands without a
+    # binary form are sent as text frames
+    if version != 2:
+        return packet(*args)
+    kind = args[0]
+    if kind in (BLOCK, LIGHT):
+        p, q, x, y, z, w = map(int, args[1:])
+        return block_frames(kind, p, q, [(x, y, z, w)])
+    if kind in (POSITION, YOU):
+        position = struct.pack('<5f', *map(float, args[2:]))
+        return frame(kind, varint(int(args[1])) + position)
+    if kind in (KEY, REDRAW, CHUNK, DISCONNECT):
+        return frame(kind, ''.join(zigzag(int(x)) for x in args[1:]))
+    return frame(TEXT_FRAME, packet(*args))
+
+def compress(data):
+    # frames of a large chunk answer, deflated into a single frame
+    if len(data) < COMPRESS_SIZE:
+        return data
+    return frame(COMPRESSED, zlib.compress(data))
+
+def encode_chunk(version, p, q, blocks, lights, signs, keys):
+    # a chunk answer up to its keys, if any, without the redraw and chunk
+    # packets
+    if version == 2:
+        data = [block_frames(BLOCK, p, q, blocks),
+            block_frames(LIGHT, p, q, lights)]
+    else:
+        data = [packet(BLOCK, p, q, *row) for row in blocks]
+        data.extend(packet(LIGHT, p, q, *row) for row in lights)
+    data.extend(encode(version, SIGN, p, q, *row) for row in signs)
+    if keys:
+        data.append(encode(version, KEY, p, q, *keys))
+    return ''.join(data)
+
 class RateLimiter(object):
     def __init__(self, rate, per):
         self.rate = float(rate)
@@ -99,6 +170,7 @@ class Handler(SocketServer.BaseRequestHandler):
         self.position_limiter = RateLimiter(100, 5)
         self.limiter = RateLimiter(1000, 10)
         self.version = None
+        self.compress = False
         self.client_id = None
         self.user_id = None
         self.nick = None
@@ -164,7 +236,7 @@ class Handler(SocketServer.BaseRequestHandler):
         if data:
             self.queue.put(data)
     def send(self, *args):
-        self.send_raw(packet(*args))
+        self.send_raw(encode(self.version, *args))
 
 class Model(object):
     def __init__(self, seed):
@@ -308,14 +380,22 @@ class Model(object):
         self.clients.remove(client)
         self.send_disconnect(client)
         self.send_talk('%s has disconnected from the server.' % client.nick)
-    def on_version(self, client, version):
+    def on_version(self, client, version, *features):
+        version = int(version)
+        if client.version == 1 and version == 2:
+            # acknowledged in text, everything after it is sent in frames
+            client.send(VERSION, version)
+            client.version = version
+            client.compress = 'zlib' in features
+            return
         if client.version is not None:
             return
-        version = int(version)
         if version != 1:
             client.stop()
             return
         client.version = version
+        # the features this server supports, old clients ignore the reply
+        client.send(VERSION, version, 'signs', 'binary', 'zlib')
         # TODO: client.start() here
     def on_authenticate(self, client, username, access_token):
         user_id = None
@@ -336,44 +416,49 @@ class Model(object):
         self.send_nick(client)
         # TODO: has left message if was already authenticated
         self.send_talk('%s has joined the game.' % client.nick)
-    def on_chunk(self, client, p, q, key=0):
-        packets = []
+    def on_chunk(self, client, p, q, key=0, sign_key=None):
+        # signs are versioned by rowid like blocks, a request without a
+        # sign key gets every live sign and the key to send next time
         p, q, key = map(int, (p, q, key))
+        full = sign_key is None or int(sign_key) == 0
+        sign_key = 0 if sign_key is None else int(sign_key)
         query = (
             'select rowid, x, y, z, w from block where '
             'p = :p and q = :q and rowid > :key;'
         )
         rows = self.execute(query, dict(p=p, q=q, key=key))
         max_rowid = 0
-        blocks = 0
+        blocks = []
         for rowid, x, y, z, w in rows:
-            blocks += 1
-            packets.append(packet(BLOCK, p, q, x, y, z, w))
+            blocks.append((x, y, z, w))
             max_rowid = max(max_rowid, rowid)
         query = (
             'select x, y, z, w from light where '
             'p = :p and q = :q;'
         )
-        rows = self.execute(query, dict(p=p, q=q))
-        lights = 0
-        for x, y, z, w in rows:
-            lights += 1
-            packets.append(packet(LIGHT, p, q, x, y, z, w))
+        lights = list(self.execute(query, dict(p=p, q=q)))
         query = (
-            'select x, y, z, face, text from sign where '
-            'p = :p and q = :q;'
+            'select rowid, x, y, z, face, text from sign where '
+            'p = :p and q = :q and rowid > :key;'
         )
-        rows = self.execute(query, dict(p=p, q=q))
-        signs = 0
-        for x, y, z, face, text in rows:
-            signs += 1
-            packets.append(packet(SIGN, p, q, x, y, z, face, text))
-        if blocks:
-            packets.append(packet(KEY, p, q, max_rowid))
+        rows = self.execute(query, dict(p=p, q=q, key=sign_key))
+        max_sign_rowid = 0
+        signs = []
+        for rowid, x, y, z, face, text in rows:
+            max_sign_rowid = max(max_sign_rowid, rowid)
+            if full and not text:
+                continue
+            signs.append((x, y, z, face, text))
+        keys = None
+        if blocks or max_sign_rowid:
+            keys = (max(max_rowid, key), max(max_sign_rowid, sign_key))
+        data = [encode_chunk(client.version, p, q,
+            blocks, lights, signs, keys)]
         if blocks or lights or signs:
-            packets.append(packet(REDRAW, p, q))
-        packets.append(packet(CHUNK, p, q))
-        client.send_raw(''.join(packets))
+            data.append(encode(client.version, REDRAW, p, q))
+        data.append(encode(client.version, CHUNK, p, q))
+        data = ''.join(data)
+        client.send_raw(compress(data) if client.compress else data)
     def on_block(self, client, x, y, z, w):
         x, y, z, w = map(int, (x, y, z, w))
         p, q = chunked(x), chunked(z)
@@ -422,10 +507,12 @@ class Model(object):
                 self.send_block(client, np, nq, x, y, z, -w)
         if w == 0:
             query = (
-                'delete from sign where '
-                'x = :x and y = :y and z = :z;'
+                'select face from sign where '
+                'x = :x and y = :y and z = :z and length(text) > 0;'
             )
-            self.execute(query, dict(x=x, y=y, z=z))
+            rows = list(self.execute(query, dict(x=x, y=y, z=z)))
+            for face, in rows:
+                self.set_sign(p, q, x, y, z, face, '')
             query = (
                 'update light set w = 0 where '
                 'x = :x and y = :y and z = :z;'
@@ -467,19 +554,27 @@ class Model(object):
             return
         p, q = chunked(x), chunked(z)
         if text:
-            query = (
-                'insert or replace into sign (p, q, x, y, z, face, text) '
-                'values (:p, :q, :x, :y, :z, :face, :text);'
-            )
-            self.execute(query,
-                dict(p=p, q=q, x=x, y=y, z=z, face=face, text=text))
+            self.set_sign(p, q, x, y, z, face, text)
         else:
             query = (
-                'delete from sign where '
-                'x = :x and y = :y and z = :z and face = :face;'
+                'select 1 from sign where '
+                'x = :x and y = :y and z = :z and face = :face and '
+                'length(text) > 0;'
             )
-            self.execute(query, dict(x=x, y=y, z=z, face=face))
+            if list(self.execute(query, dict(x=x, y=y, z=z, face=face))):
+                self.set_sign(p, q, x, y, z, face, '')
         self.send_sign(client, p, q, x, y, z, face, text)
+    def set_sign(self, p, q, x, y, z, face, text):
+        # every change moves the sign past all other rowids, deleted signs
+        # stay behind with empty text so that clients learn about them
+        query = (
+            'insert or replace into sign '
+            '(rowid, p, q, x, y, z, face, text) values ('
+            '(select coalesce(max(rowid), 0) + 1 from sign), '
+            ':p, :q, :x, :y, :z, :face, :text);'
+        )
+        self.execute(query,
+            dict(p=p, q=q, x=x, y=y, z=z, face=face, text=text))
     def on_position(self, client, x, y, z, rx, ry):
         x, y, z, rx, ry = map(float, (x, y, z, rx, ry))
         client.position = (x, y, z, rx, ry)
@@ -655,10 +750,50 @@ def cleanup():
     print 'commit;'
     print >> sys.stderr, '%d of %d blocks will be cleaned up' % (count, total)
 
+def bench(path):
+    # bytes per chunk of both protocols, and of compressed frames, for
+    # every chunk in the database, and how fast the server encodes them
+    conn = sqlite3.connect(path)
+    query = 'select distinct p, q from block;'
+    chunks = list(conn.execute(query))
+    answers = []
+    for p, q in chunks:
+        query = 'select x, y, z, w from block where p = :p and q = :q;'
+        blocks = list(conn.execute(query, dict(p=p, q=q)))
+        query = 'select x, y, z, w from light where p = :p and q = :q;'
+        lights = list(conn.execute(query, dict(p=p, q=q)))
+        query = (
+            'select x, y, z, face, text from sign where '
+            'p = :p and q = :q and length(text) > 0;'
+        )
+        signs = list(conn.execute(query, dict(p=p, q=q)))
+        answers.append((p, q, blocks, lights, signs))
+    conn.close()
+    print '%d chunks' % len(answers)
+    for name, version, deflate in (
+        ('protocol 1', 1, False),
+        ('protocol 2', 2, False),
+        ('protocol 2 with zlib', 2, True)):
+        size = 0
+        start = time.time()
+        for p, q, blocks, lights, signs in answers:
+            data = encode_chunk(
+                version, p, q, blocks, lights, signs, (1, 1))
+            data += encode(version, REDRAW, p, q)
+            data += encode(version, CHUNK, p, q)
+            size += len(compress(data) if deflate else data)
+        elapsed = max(time.time() - start, 1e-6)
+        print '%s: %d bytes, %d bytes/chunk, %.1f MB/sec' % (
+            name, size, size / max(len(answers), 1),
+            size / 1048576.0 / elapsed)
+
 def main():
     if len(sys.argv) == 2 and sys.argv[1] == 'cleanup':
         cleanup()
         return
+    if len(sys.argv) in (2, 3) and sys.argv[1] == 'bench':
+        bench(sys.argv[2] if len(sys.argv) == 3 else DB_PATH)
+        return
     host, port = DEFAULT_HOST, DEFAULT_PORT
     if len(sys.argv) > 1:
         host = sys.argv[1]
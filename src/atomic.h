@@ -0,0 +1,20 @@
+#ifndef _atomic_h_
+#define _atomic_h_
+
+// thin wrappers over the gcc / clang builtins (also available in mingw)
+
+#define ATOMIC_LOAD(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(ptr, value) \
+    __atomic_store_n((ptr), (value), __ATOMIC_RELEASE)
+#define ATOMIC_EXCHANGE(ptr, value) \
+    __atomic_exchange_n((ptr), (value), __ATOMIC_ACQ_REL)
+#define ATOMIC_ADD(ptr, value) \
+    __atomic_add_fetch((ptr), (value), __ATOMIC_ACQ_REL)
+#define ATOMIC_SUB(ptr, value) \
+    __atomic_sub_fetch((ptr), (value), __ATOMIC_ACQ_REL)
+#define ATOMIC_CAS(ptr, expected, value) \
+    __atomic_compare_exchange_n((ptr), (expected), (value), 0, \
+        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#define ATOMIC_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+#endif
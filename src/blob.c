@@ -0,0 +1,138 @@
+#include <stdlib.h>
+#include "blob.h"
+#include "config.h"
+
+// A chunk is stored as runs of voxels sorted by key, each run encoded as
+// three varints: the gap since the end of the previous run, the run
+// length minus one and the zigzag encoded value. Keys are the same
+// 8 bit offsets from (p * CHUNK_SIZE - 1, 0, q * CHUNK_SIZE - 1) that a
+// Map uses, in y, z, x order so that runs follow the x axis.
+
+#define BLOB_VERSION 1
+
+int blob_key(int p, int q, int x, int y, int z) {
+    x -= p * CHUNK_SIZE - 1;
+    z -= q * CHUNK_SIZE - 1;
+    return ((y & 0xff) << 16) | ((z & 0xff) << 8) | (x & 0xff);
+}
+
+void blob_position(int p, int q, int key, int *x, int *y, int *z) {
+    *x = (key & 0xff) + p * CHUNK_SIZE - 1;
+    *y = (key >> 16) & 0xff;
+    *z = ((key >> 8) & 0xff) + q * CHUNK_SIZE - 1;
+}
+
+int voxel_compare(const void *a, const void *b) {
+    return ((Voxel *)a)->key - ((Voxel *)b)->key;
+}
+
+void blob_sort(Voxel *voxels, int count) {
+    qsort(voxels, count, sizeof(Voxel), voxel_compare);
+}
+
+Voxel *blob_merge(
+    Voxel *a, int a_count, Voxel *b, int b_count, int *count)
+{
+    // both sorted, b wins on equal keys
+    Voxel *result = (Voxel *)malloc(sizeof(Voxel) * (a_count + b_count + 1));
+    int i = 0, j = 0, n = 0;
+    while (i < a_count || j < b_count) {
+        if (j == b_count || (i < a_count && a[i].key < b[j].key)) {
+            result[n++] = a[i++];
+        }
+        else {
+            if (i < a_count && a[i].key == b[j].key) {
+                i++;
+            }
+            result[n++] = b[j++];
+        }
+    }
+    *count = n;
+    return result;
+}
+
+static int put_varint(unsigned char *data, unsigned int value) {
+    int n = 0;
+    while (value >= 0x80) {
+        data[n++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    data[n++] = value;
+    return n;
+}
+
+static int get_varint(
+    const unsigned char *data, int size, int *offset, unsigned int *value)
+{
+    unsigned int result = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (*offset >= size) {
+            return 0;
+        }
+        unsigned char c = data[(*offset)++];
+        result |= (unsigned int)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            *value = result;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+unsigned char *blob_encode(Voxel *voxels, int count, int *size) {
+    unsigned char *data = (unsigned char *)malloc(1 + count * 15);
+    int n = 0;
+    data[n++] = BLOB_VERSION;
+    int end = 0;
+    for (int i = 0; i < count;) {
+        int run = 1;
+        while (i + run < count &&
+            voxels[i + run].key == voxels[i].key + run &&
+            voxels[i + run].w == voxels[i].w)
+        {
+            run++;
+        }
+        int w = voxels[i].w;
+        n += put_varint(data + n, voxels[i].key - end);
+        n += put_varint(data + n, run - 1);
+        n += put_varint(data + n,
+            ((unsigned int)w << 1) ^ (unsigned int)(w >> 31));
+        end = voxels[i].key + run;
+        i += run;
+    }
+    *size = n;
+    return data;
+}
+
+Voxel *blob_decode(const unsigned char *data, int size, int *count) {
+    *count = 0;
+    if (size < 1 || data[0] != BLOB_VERSION) {
+        return 0;
+    }
+    int capacity = 64;
+    Voxel *voxels = (Voxel *)malloc(sizeof(Voxel) * capacity);
+    int offset = 1;
+    int end = 0;
+    unsigned int gap, run, zigzag;
+    while (offset < size) {
+        if (!get_varint(data, size, &offset, &gap) ||
+            !get_varint(data, size, &offset, &run) ||
+            !get_varint(data, size, &offset, &zigzag))
+        {
+            break;
+        }
+        int key = end + gap;
+        int w = (int)(zigzag >> 1) ^ -(int)(zigzag & 1);
+        for (unsigned int i = 0; i <= run; i++) {
+            if (*count == capacity) {
+                capacity *= 2;
+                voxels = (Voxel *)realloc(voxels, sizeof(Voxel) * capacity);
+            }
+            voxels[*count].key = key + i;
+            voxels[*count].w = w;
+            (*count)++;
+        }
+        end = key + run + 1;
+    }
+    return voxels;
+}
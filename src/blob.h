@@ -0,0 +1,17 @@
+#ifndef _blob_h_
+#define _blob_h_
+
+typedef struct {
+    int key;
+    int w;
+} Voxel;
+
+int blob_key(int p, int q, int x, int y, int z);
+void blob_position(int p, int q, int key, int *x, int *y, int *z);
+void blob_sort(Voxel *voxels, int count);
+Voxel *blob_merge(
+    Voxel *a, int a_count, Voxel *b, int b_count, int *count);
+unsigned char *blob_encode(Voxel *voxels, int count, int *size);
+Voxel *blob_decode(const unsigned char *data, int size, int *count);
+
+#endif
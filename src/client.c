@@ -2,9 +2,10 @@
     #include <winsock2.h>
     #include <windows.h>
     #define close closesocket
-    #define sleep Sleep
+    #define SHUT_RDWR SD_BOTH
 #else
     #include <netdb.h>
+    #include <sys/socket.h>
     #include <unistd.h>
 #endif
 
@@ -12,20 +13,60 @@
 #include <stdlib.h>
 #include <string.h>
 #include "client.h"
+#include "lodepng.h"
 #include "tinycthread.h"
 
-#define QUEUE_SIZE 1048576
-#define RECV_SIZE 4096
+#define QUEUE_SIZE 65536
+#define QUEUE_LIMIT (16 << 20)
+
+#define RECV_TEXT 0
+#define RECV_UPGRADE 1
+#define RECV_FRAMES 2
+
+// Received data goes straight into a ring buffer that doubles when full,
+// up to QUEUE_LIMIT, after which the receiver waits for lines to be
+// consumed. Lines are handed out in place, only those that wrap around
+// the end of the ring are copied. A buffer replaced by a bigger one stays
+// alive until the line views into it are released. Once the server has
+// answered V,2 the same goes for the binary frames that follow, each behind
+// a varint length. The receiver walks the frames before handing them over
+// and inflates compressed ones into a list of payloads, which are read in
+// the place of their frame.
+
+typedef struct Payload {
+    unsigned char *data;
+    int size;
+    struct Payload *next;
+} Payload;
 
 static int client_enabled = 0;
 static int running = 0;
 static int sd = 0;
 static int bytes_sent = 0;
 static int bytes_received = 0;
+static int stats_received = 0;
+static int stats_chunk_bytes = 0;
+static int protocol = 1;
+static int voxels[MAX_MESSAGE_VOXELS * 4];
 static char *queue = 0;
+static char *retired = 0;
+static int capacity = 0;
+static int qstart = 0;
 static int qsize = 0;
+static int ready = 0;
+static int recv_state = RECV_TEXT;
+static Payload *payloads = 0;
+static Payload *last_payload = 0;
+static int payload_bytes = 0;
+static Payload *payload = 0;
+static int payload_offset = 0;
+static int scanned = 0;
+static int consumed = 0;
+static char *line = 0;
+static int line_capacity = 0;
 static thrd_t recv_thread;
 static mtx_t mutex;
+static cnd_t space;
 
 void client_enable() {
     client_enabled = 1;
@@ -75,6 +116,19 @@ void client_version(int version) {
     client_send(buffer);
 }
 
+void client_upgrade(int compress) {
+    // called while the line announcing binary frames is held, the receiver
+    // looks for the V,2 answer in the lines after it
+    if (!client_enabled) {
+        return;
+    }
+    mtx_lock(&mutex);
+    recv_state = RECV_UPGRADE;
+    ready = consumed;
+    mtx_unlock(&mutex);
+    client_send(compress ? "V,2,zlib\n" : "V,2\n");
+}
+
 void client_login(const char *username, const char *identity_token) {
     if (!client_enabled) {
         return;
@@ -104,12 +158,18 @@ void client_position(float x, float y, float z, float rx, float ry) {
     client_send(buffer);
 }
 
-void client_chunk(int p, int q, int key) {
+void client_chunk(int p, int q, int key, int sign_key) {
+    // servers that do not version signs are sent no sign key
     if (!client_enabled) {
         return;
     }
     char buffer[1024];
-    snprintf(buffer, 1024, "C,%d,%d,%d\n", p, q, key);
+    if (sign_key < 0) {
+        snprintf(buffer, 1024, "C,%d,%d,%d\n", p, q, key);
+    }
+    else {
+        snprintf(buffer, 1024, "C,%d,%d,%d,%d\n", p, q, key, sign_key);
+    }
     client_send(buffer);
 }
 
@@ -152,60 +212,344 @@ void client_talk(const char *text) {
     client_send(buffer);
 }
 
-char *client_recv() {
-    if (!client_enabled) {
+static void queue_grow() {
+    // called with the mutex held on a full queue, the line being parsed
+    // is left behind in the retired buffer and only its room is kept
+    char *data = (char *)malloc(capacity * 2);
+    int from = (qstart + consumed) & (capacity - 1);
+    int count = qsize - consumed;
+    int head = count < capacity - from ? count : capacity - from;
+    memcpy(data + consumed, queue + from, head);
+    memcpy(data + consumed + head, queue, count - head);
+    retired = queue;
+    queue = data;
+    qstart = 0;
+    capacity *= 2;
+}
+
+static char *queue_view(char *data, int size, int start, int length) {
+    // the data in place, or a copy of it when it wraps around
+    if (start + length <= size) {
+        return data + start;
+    }
+    if (length > line_capacity) {
+        line_capacity = length * 2;
+        line = (char *)realloc(line, line_capacity);
+    }
+    int head = size - start;
+    memcpy(line, data + start, head);
+    memcpy(line + head, data, length - head);
+    return line;
+}
+
+static int queue_scan() {
+    // the length of the next line, 0 until it is complete
+    while (scanned < ready) {
+        int offset = (qstart + scanned) & (capacity - 1);
+        int length = ready - scanned;
+        if (length > capacity - offset) {
+            length = capacity - offset;
+        }
+        char *end = (char *)memchr(queue + offset, '\n', length);
+        if (end) {
+            length = scanned + (end - (queue + offset)) + 1;
+            scanned = 0;
+            return length;
+        }
+        scanned += length;
+    }
+    return 0;
+}
+
+static int get_frame(unsigned char *data, int size, int *header) {
+    // the length of the frame at data, of which size bytes are there, and
+    // of its varint length prefix, 0 until the prefix is complete
+    unsigned int length = 0;
+    int i;
+    for (i = 0; i < 5 && i < size; i++) {
+        length |= (unsigned int)(data[i] & 0x7f) << (7 * i);
+        if (!(data[i] & 0x80)) {
+            break;
+        }
+    }
+    if (i == 5 || (i < size && (length == 0 || length > QUEUE_LIMIT - 5))) {
+        fprintf(stderr, "client_recv: bad frame length\n");
+        exit(1);
+    }
+    if (i == size) {
         return 0;
     }
-    char *result = 0;
-    mtx_lock(&mutex);
-    char *p = queue + qsize - 1;
-    while (p >= queue && *p != '\n') {
-        p--;
-    }
-    if (p >= queue) {
-        int length = p - queue + 1;
-        result = malloc(sizeof(char) * (length + 1));
-        memcpy(result, queue, sizeof(char) * length);
-        result[length] = '\0';
-        int remaining = qsize - length;
-        memmove(queue, p + 1, remaining);
-        qsize -= length;
-        bytes_received += length;
+    *header = i + 1;
+    return *header + length;
+}
+
+static int queue_frame(int offset, int limit, int *header) {
+    // the length of the frame at offset in the queue, 0 until it is
+    // complete before limit
+    unsigned char data[5];
+    int size = limit - offset < 5 ? limit - offset : 5;
+    for (int i = 0; i < size; i++) {
+        data[i] = queue[(qstart + offset + i) & (capacity - 1)];
+    }
+    int length = get_frame(data, size, header);
+    return length && offset + length <= limit ? length : 0;
+}
+
+static int queue_upgrade() {
+    // the length of the next line, 0 until it is complete, switching to
+    // frames after the V,2 answer
+    int offset = (qstart + ready) & (capacity - 1);
+    int length = qsize - ready;
+    char *end = (char *)memchr(queue + offset, '\n',
+        length < capacity - offset ? length : capacity - offset);
+    if (!end && length > capacity - offset) {
+        end = (char *)memchr(queue, '\n', length - (capacity - offset));
+    }
+    if (!end) {
+        return 0;
+    }
+    char text[4];
+    int size = end >= queue + offset ?
+        end - (queue + offset) + 1 : capacity - offset + (end - queue) + 1;
+    for (int i = 0; i < 4 && i < size; i++) {
+        text[i] = queue[(offset + i) & (capacity - 1)];
+    }
+    if (size == 4 && memcmp(text, "V,2\n", 4) == 0) {
+        recv_state = RECV_FRAMES;
+    }
+    return size;
+}
+
+static void queue_inflate(int header, int length) {
+    // called with the mutex held and released while inflating, nobody else
+    // touches the queue past the ready data
+    int start = (qstart + ready + header + 1) & (capacity - 1);
+    int size = length - header - 1;
+    unsigned char *data = (unsigned char *)queue + start;
+    unsigned char *copy = 0;
+    if (start + size > capacity) {
+        copy = (unsigned char *)malloc(size);
+        memcpy(copy, data, capacity - start);
+        memcpy(copy + capacity - start, queue, size - (capacity - start));
+        data = copy;
     }
     mtx_unlock(&mutex);
-    return result;
+    Payload *item = (Payload *)calloc(1, sizeof(Payload));
+    size_t result_size = 0;
+    if (lodepng_zlib_decompress(&item->data, &result_size, data, size,
+        &lodepng_default_decompress_settings))
+    {
+        fprintf(stderr, "client_recv: bad compressed frame\n");
+        exit(1);
+    }
+    item->size = result_size;
+    free(copy);
+    mtx_lock(&mutex);
+    if (last_payload) {
+        last_payload->next = item;
+    }
+    else {
+        payloads = item;
+    }
+    last_payload = item;
+    payload_bytes += item->size;
 }
 
-int recv_worker(void *arg) {
-    char *data = malloc(sizeof(char) * RECV_SIZE);
+static void queue_ready() {
+    // called with the mutex held, hands whole lines and frames over, or
+    // everything in plain text mode
+    while (ready < qsize) {
+        if (recv_state == RECV_TEXT) {
+            ready = qsize;
+            return;
+        }
+        if (recv_state == RECV_UPGRADE) {
+            int length = queue_upgrade();
+            if (!length) {
+                return;
+            }
+            ready += length;
+            continue;
+        }
+        int header;
+        int length = queue_frame(ready, qsize, &header);
+        if (!length) {
+            return;
+        }
+        char kind = queue[(qstart + ready + header) & (capacity - 1)];
+        if (kind == 'Z') {
+            if (payload_bytes > QUEUE_LIMIT) {
+                return;
+            }
+            queue_inflate(header, length);
+        }
+        ready += length;
+    }
+}
+
+static int chunk_message(char type) {
+    return type == 'B' || type == 'L' || type == 'S' ||
+        type == 'K' || type == 'R' || type == 'C';
+}
+
+static int payload_message(Message *message) {
+    // the next frame of the payload being read, -1 when it is used up
+    if (payload_offset == payload->size) {
+        return -1;
+    }
+    unsigned char *data = payload->data + payload_offset;
+    int header;
+    int length = get_frame(data, payload->size - payload_offset, &header);
+    if (!length || length > payload->size - payload_offset) {
+        fprintf(stderr, "client_recv: bad compressed frame\n");
+        exit(1);
+    }
+    payload_offset += length;
+    return message_decode(data + header, length - header, message, voxels);
+}
+
+int client_recv(Message *message) {
+    // fills in the next message, which may point into the receive buffer
+    // and is valid until the next call, returns 0 when there is none
+    if (!client_enabled) {
+        return 0;
+    }
     while (1) {
-        int length;
-        if ((length = recv(sd, data, RECV_SIZE - 1, 0)) <= 0) {
-            if (running) {
-                perror("recv");
-                exit(1);
+        if (payload) {
+            int result = payload_message(message);
+            if (result > 0) {
+                return 1;
             }
-            else {
-                break;
+            if (!result) {
+                continue;
             }
         }
-        data[length] = '\0';
-        while (1) {
-            int done = 0;
+        mtx_lock(&mutex);
+        if (payload) {
+            payload_bytes -= payload->size;
+            free(payload->data);
+            free(payload);
+            payload = 0;
+            cnd_signal(&space);
+        }
+        if (consumed) {
+            qstart = (qstart + consumed) & (capacity - 1);
+            qsize -= consumed;
+            ready -= consumed;
+            bytes_received += consumed;
+            consumed = 0;
+            cnd_signal(&space);
+        }
+        if (retired) {
+            // the receiver may be waiting to grow the queue again
+            free(retired);
+            retired = 0;
+            cnd_signal(&space);
+        }
+        int header = 0;
+        consumed = protocol == 1 ?
+            queue_scan() : queue_frame(0, ready, &header);
+        char *data = queue;
+        int size = capacity;
+        int start = (qstart + header) & (capacity - 1);
+        mtx_unlock(&mutex);
+        // the receiver neither touches the data nor frees its buffer until
+        // we release it with the next call
+        if (!consumed) {
+            return 0;
+        }
+        int length = consumed - header;
+        char *unit = queue_view(data, size, start, length);
+        int result;
+        stats_received += consumed;
+        if (protocol == 1) {
+            unit[length - 1] = '\0';
+            if (strcmp(unit, "V,2") == 0) {
+                // the server switched to frames right after this line
+                protocol = 2;
+                continue;
+            }
+            result = message_parse(unit, message);
+        }
+        else if (unit[0] == 'Z') {
+            // inflated by the receiver, in order
             mtx_lock(&mutex);
-            if (qsize + length < QUEUE_SIZE) {
-                memcpy(queue + qsize, data, sizeof(char) * (length + 1));
-                qsize += length;
-                done = 1;
+            payload = payloads;
+            payloads = payload->next;
+            if (!payloads) {
+                last_payload = 0;
             }
             mtx_unlock(&mutex);
-            if (done) {
+            payload_offset = 0;
+            stats_chunk_bytes += consumed;
+            continue;
+        }
+        else {
+            result = message_decode(
+                (unsigned char *)unit, length, message, voxels);
+        }
+        if (result && chunk_message(message->type)) {
+            stats_chunk_bytes += consumed;
+        }
+        if (result) {
+            return 1;
+        }
+    }
+}
+
+void client_stats(int *received, int *chunk_bytes) {
+    // bytes received since the last call, and how many were chunk data
+    *received = stats_received;
+    *chunk_bytes = stats_chunk_bytes;
+    stats_received = 0;
+    stats_chunk_bytes = 0;
+}
+
+int recv_worker(void *arg) {
+    while (1) {
+        mtx_lock(&mutex);
+        while (1) {
+            queue_ready();
+            if (!running) {
+                break;
+            }
+            if (payload_bytes > QUEUE_LIMIT) {
+                cnd_wait(&space, &mutex);
+            }
+            else if (qsize < capacity) {
+                break;
+            }
+            else if (capacity < QUEUE_LIMIT && !retired) {
+                queue_grow();
+            }
+            else {
+                cnd_wait(&space, &mutex);
+            }
+        }
+        if (!running) {
+            mtx_unlock(&mutex);
+            break;
+        }
+        // only we write past the end of the queued data
+        int end = (qstart + qsize) & (capacity - 1);
+        int length = end < qstart ? qstart - end : capacity - end;
+        char *data = queue + end;
+        mtx_unlock(&mutex);
+        length = recv(sd, data, length, 0);
+        mtx_lock(&mutex);
+        int stopped = !running;
+        if (length > 0) {
+            qsize += length;
+        }
+        mtx_unlock(&mutex);
+        if (length <= 0) {
+            if (stopped) {
                 break;
             }
-            sleep(0);
+            perror("recv");
+            exit(1);
         }
     }
-    free(data);
     return 0;
 }
 
@@ -238,9 +582,17 @@ void client_start() {
         return;
     }
     running = 1;
+    protocol = 1;
     queue = (char *)calloc(QUEUE_SIZE, sizeof(char));
+    capacity = QUEUE_SIZE;
+    qstart = 0;
     qsize = 0;
+    ready = 0;
+    recv_state = RECV_TEXT;
+    scanned = 0;
+    consumed = 0;
     mtx_init(&mutex, mtx_plain);
+    cnd_init(&space);
     if (thrd_create(&recv_thread, recv_worker, NULL) != thrd_success) {
         perror("thrd_create");
         exit(1);
@@ -251,15 +603,42 @@ void client_stop() {
     if (!client_enabled) {
         return;
     }
+    // shutdown wakes the receiver from recv, the broadcast from a wait
+    // for space, so that it can be joined before the queue goes away
+    mtx_lock(&mutex);
     running = 0;
+    cnd_broadcast(&space);
+    mtx_unlock(&mutex);
+    shutdown(sd, SHUT_RDWR);
+    if (thrd_join(recv_thread, NULL) != thrd_success) {
+        perror("thrd_join");
+        exit(1);
+    }
     close(sd);
-    // if (thrd_join(recv_thread, NULL) != thrd_success) {
-    //     perror("thrd_join");
-    //     exit(1);
-    // }
-    // mtx_destroy(&mutex);
+    mtx_destroy(&mutex);
+    cnd_destroy(&space);
     qsize = 0;
+    ready = 0;
+    if (payload) {
+        payload->next = payloads;
+        payloads = payload;
+    }
+    while (payloads) {
+        Payload *next = payloads->next;
+        free(payloads->data);
+        free(payloads);
+        payloads = next;
+    }
+    payload = 0;
+    last_payload = 0;
+    payload_bytes = 0;
     free(queue);
+    free(retired);
+    free(line);
+    queue = 0;
+    retired = 0;
+    line = 0;
+    line_capacity = 0;
     // printf("Bytes Sent: %d, Bytes Received: %d\n",
     //     bytes_sent, bytes_received);
 }
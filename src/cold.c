@@ -0,0 +1,345 @@
+#include <stdlib.h>
+#include <string.h>
+#include "blob.h"
+#include "cold.h"
+#include "lodepng.h"
+
+// Chunks that scroll out of view are kept here, compressed, so that flying
+// back to them skips terrain generation, the database and, when the mesh
+// was kept too, meshing. Entries are reserved when a chunk is evicted and
+// filled once a worker has packed it, anything that touches the chunk in
+// between removes the reservation and the packed copy is dropped.
+
+void cold_cache_alloc(ColdCache *cache, size_t budget) {
+    memset(cache, 0, sizeof(ColdCache));
+    cache->budget = budget;
+    cache->mask = 0xff;
+    cache->buckets = (ColdEntry **)calloc(cache->mask + 1, sizeof(ColdEntry *));
+}
+
+void cold_cache_free(ColdCache *cache) {
+    cold_cache_clear(cache);
+    free(cache->buckets);
+}
+
+static size_t cold_entry_cost(ColdEntry *entry) {
+    return sizeof(ColdEntry) + entry->size + entry->mesh_size;
+}
+
+static ColdEntry **cold_cache_find(ColdCache *cache, int p, int q) {
+    unsigned int index = hash(p, q, 0) & cache->mask;
+    ColdEntry **link = cache->buckets + index;
+    while (*link && ((*link)->p != p || (*link)->q != q)) {
+        link = &(*link)->chain;
+    }
+    return link;
+}
+
+static void cold_cache_unlink(ColdCache *cache, ColdEntry *entry) {
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    }
+    else {
+        cache->head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    }
+    else {
+        cache->tail = entry->prev;
+    }
+    entry->prev = 0;
+    entry->next = 0;
+}
+
+static void cold_cache_push(ColdCache *cache, ColdEntry *entry) {
+    entry->prev = 0;
+    entry->next = cache->head;
+    if (cache->head) {
+        cache->head->prev = entry;
+    }
+    else {
+        cache->tail = entry;
+    }
+    cache->head = entry;
+}
+
+static void cold_cache_delete(ColdCache *cache, ColdEntry **link) {
+    ColdEntry *entry = *link;
+    *link = entry->chain;
+    cold_cache_unlink(cache, entry);
+    cache->used -= cold_entry_cost(entry);
+    cache->size--;
+    cold_entry_free(entry);
+}
+
+static void cold_cache_grow(ColdCache *cache) {
+    unsigned int mask = (cache->mask << 1) | 1;
+    ColdEntry **buckets = (ColdEntry **)calloc(mask + 1, sizeof(ColdEntry *));
+    for (unsigned int i = 0; i <= cache->mask; i++) {
+        ColdEntry *entry = cache->buckets[i];
+        while (entry) {
+            ColdEntry *chain = entry->chain;
+            unsigned int index = hash(entry->p, entry->q, 0) & mask;
+            entry->chain = buckets[index];
+            buckets[index] = entry;
+            entry = chain;
+        }
+    }
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->mask = mask;
+}
+
+void cold_cache_clear(ColdCache *cache) {
+    while (cache->tail) {
+        ColdEntry *entry = cache->tail;
+        cold_cache_delete(cache, cold_cache_find(cache, entry->p, entry->q));
+    }
+}
+
+void cold_cache_reserve(ColdCache *cache, int p, int q, int id) {
+    cold_cache_remove(cache, p, q);
+    ColdEntry *entry = (ColdEntry *)calloc(1, sizeof(ColdEntry));
+    entry->p = p;
+    entry->q = q;
+    entry->id = id;
+    ColdEntry **link = cold_cache_find(cache, p, q);
+    *link = entry;
+    cold_cache_push(cache, entry);
+    cache->used += cold_entry_cost(entry);
+    cache->size++;
+    if (cache->size > cache->mask) {
+        cold_cache_grow(cache);
+    }
+}
+
+void cold_cache_fill(ColdCache *cache, ColdEntry *entry) {
+    // takes the packed entry, which is dropped unless still reserved
+    ColdEntry **link = cold_cache_find(cache, entry->p, entry->q);
+    ColdEntry *reserved = *link;
+    if (!reserved || reserved->id != entry->id || reserved->data) {
+        cold_entry_free(entry);
+        return;
+    }
+    if (!entry->data) {
+        cold_cache_delete(cache, link);
+        cold_entry_free(entry);
+        return;
+    }
+    cache->used -= cold_entry_cost(reserved);
+    reserved->data = entry->data;
+    reserved->size = entry->size;
+    reserved->mesh = entry->mesh;
+    reserved->mesh_size = entry->mesh_size;
+    reserved->faces = entry->faces;
+    reserved->miny = entry->miny;
+    reserved->maxy = entry->maxy;
+    cache->used += cold_entry_cost(reserved);
+    free(entry);
+    cold_cache_unlink(cache, reserved);
+    cold_cache_push(cache, reserved);
+    while (cache->used > cache->budget && cache->tail) {
+        ColdEntry *last = cache->tail;
+        cold_cache_delete(cache, cold_cache_find(cache, last->p, last->q));
+    }
+}
+
+ColdEntry *cold_cache_take(ColdCache *cache, int p, int q) {
+    ColdEntry **link = cold_cache_find(cache, p, q);
+    ColdEntry *entry = *link;
+    if (!entry) {
+        cache->misses++;
+        return 0;
+    }
+    if (!entry->data) {
+        // still being packed, the packed copy will find nothing to fill
+        cache->misses++;
+        cold_cache_delete(cache, link);
+        return 0;
+    }
+    *link = entry->chain;
+    entry->chain = 0;
+    cold_cache_unlink(cache, entry);
+    cache->used -= cold_entry_cost(entry);
+    cache->size--;
+    cache->hits++;
+    return entry;
+}
+
+void cold_cache_remove(ColdCache *cache, int p, int q) {
+    ColdEntry **link = cold_cache_find(cache, p, q);
+    if (*link) {
+        cold_cache_delete(cache, link);
+    }
+}
+
+void cold_cache_drop_mesh(ColdCache *cache, int p, int q) {
+    ColdEntry *entry = *cold_cache_find(cache, p, q);
+    if (entry && entry->mesh) {
+        cache->used -= entry->mesh_size;
+        free(entry->mesh);
+        entry->mesh = 0;
+        entry->mesh_size = 0;
+    }
+    else if (entry && !entry->data) {
+        // the mesh is still being packed
+        cold_cache_remove(cache, p, q);
+    }
+}
+
+static unsigned char *cold_compress(
+    unsigned char *data, size_t size, int *result_size)
+{
+    LodePNGCompressSettings settings;
+    lodepng_compress_settings_init(&settings);
+    settings.lazymatching = 0;
+    unsigned char *result = 0;
+    size_t length = 0;
+    if (lodepng_zlib_compress(&result, &length, data, size, &settings)) {
+        free(result);
+        *result_size = 0;
+        return 0;
+    }
+    *result_size = length;
+    return result;
+}
+
+static unsigned char *cold_decompress(
+    unsigned char *data, int size, size_t *result_size)
+{
+    unsigned char *result = 0;
+    *result_size = 0;
+    if (lodepng_zlib_decompress(&result, result_size, data, size,
+        &lodepng_default_decompress_settings))
+    {
+        free(result);
+        *result_size = 0;
+        return 0;
+    }
+    return result;
+}
+
+static Voxel *cold_voxels(Map *map, int p, int q, int *count) {
+    Voxel *voxels = (Voxel *)malloc(sizeof(Voxel) * (map->size + 1));
+    int n = 0;
+    MAP_FOR_EACH(map, ex, ey, ez, ew) {
+        voxels[n].key = blob_key(p, q, ex, ey, ez);
+        voxels[n++].w = ew;
+    } END_MAP_FOR_EACH;
+    blob_sort(voxels, n);
+    *count = n;
+    return voxels;
+}
+
+ColdEntry *cold_pack(
+    int p, int q, int id, Map *blocks, Map *lights, SignList *signs)
+{
+    // block blob, light blob and signs, each behind its size, deflated
+    int block_count, light_count, block_size, light_size;
+    Voxel *block_voxels = cold_voxels(blocks, p, q, &block_count);
+    Voxel *light_voxels = cold_voxels(lights, p, q, &light_count);
+    unsigned char *block_data =
+        blob_encode(block_voxels, block_count, &block_size);
+    unsigned char *light_data =
+        blob_encode(light_voxels, light_count, &light_size);
+    size_t size = sizeof(int) * 3 + block_size + light_size +
+        signs->size * (sizeof(int) * 4 + MAX_SIGN_LENGTH);
+    unsigned char *data = (unsigned char *)malloc(size);
+    unsigned char *end = data;
+    int header[3] = {block_size, light_size, signs->size};
+    memcpy(end, header, sizeof(header));
+    end += sizeof(header);
+    memcpy(end, block_data, block_size);
+    end += block_size;
+    memcpy(end, light_data, light_size);
+    end += light_size;
+    for (unsigned int i = 0; i < signs->size; i++) {
+        Sign *e = signs->data + i;
+        int values[4] = {e->x, e->y, e->z, e->face};
+        memcpy(end, values, sizeof(values));
+        end += sizeof(values);
+        int length = strlen(e->text) + 1;
+        memcpy(end, e->text, length);
+        end += length;
+    }
+    ColdEntry *entry = (ColdEntry *)calloc(1, sizeof(ColdEntry));
+    entry->p = p;
+    entry->q = q;
+    entry->id = id;
+    entry->data = cold_compress(data, end - data, &entry->size);
+    free(block_voxels);
+    free(light_voxels);
+    free(block_data);
+    free(light_data);
+    free(data);
+    return entry;
+}
+
+void cold_pack_mesh(
+    ColdEntry *entry, float *data, int faces, int miny, int maxy)
+{
+    entry->mesh = cold_compress((unsigned char *)data,
+        sizeof(float) * faces * 60, &entry->mesh_size);
+    entry->faces = faces;
+    entry->miny = miny;
+    entry->maxy = maxy;
+}
+
+static void cold_map_set(
+    Map *map, int p, int q, unsigned char *data, int size)
+{
+    int count;
+    Voxel *voxels = blob_decode(data, size, &count);
+    for (int i = 0; i < count; i++) {
+        int x, y, z;
+        blob_position(p, q, voxels[i].key, &x, &y, &z);
+        map_set(map, x, y, z, voxels[i].w);
+    }
+    free(voxels);
+}
+
+int cold_unpack(ColdEntry *entry, Map *blocks, Map *lights, SignList *signs) {
+    size_t size;
+    unsigned char *data = cold_decompress(entry->data, entry->size, &size);
+    if (!data) {
+        return -1;
+    }
+    unsigned char *end = data;
+    int header[3];
+    memcpy(header, end, sizeof(header));
+    end += sizeof(header);
+    cold_map_set(blocks, entry->p, entry->q, end, header[0]);
+    end += header[0];
+    cold_map_set(lights, entry->p, entry->q, end, header[1]);
+    end += header[1];
+    for (int i = 0; i < header[2]; i++) {
+        int values[4];
+        memcpy(values, end, sizeof(values));
+        end += sizeof(values);
+        sign_list_add(signs, values[0], values[1], values[2], values[3],
+            (char *)end);
+        end += strlen((char *)end) + 1;
+    }
+    free(data);
+    return 0;
+}
+
+float *cold_unpack_mesh(ColdEntry *entry) {
+    if (!entry->mesh) {
+        return 0;
+    }
+    size_t size;
+    unsigned char *data = cold_decompress(entry->mesh, entry->mesh_size, &size);
+    if (data && size != sizeof(float) * entry->faces * 60) {
+        free(data);
+        return 0;
+    }
+    return (float *)data;
+}
+
+void cold_entry_free(ColdEntry *entry) {
+    free(entry->data);
+    free(entry->mesh);
+    free(entry);
+}
@@ -0,0 +1,53 @@
+#ifndef _cold_h_
+#define _cold_h_
+
+#include <stddef.h>
+#include "map.h"
+#include "sign.h"
+
+typedef struct ColdEntry {
+    int p;
+    int q;
+    int id;
+    unsigned char *data;
+    int size;
+    unsigned char *mesh;
+    int mesh_size;
+    int faces;
+    int miny;
+    int maxy;
+    struct ColdEntry *chain;
+    struct ColdEntry *prev;
+    struct ColdEntry *next;
+} ColdEntry;
+
+typedef struct {
+    size_t budget;
+    size_t used;
+    unsigned int mask;
+    unsigned int size;
+    ColdEntry **buckets;
+    ColdEntry *head;
+    ColdEntry *tail;
+    int hits;
+    int misses;
+} ColdCache;
+
+void cold_cache_alloc(ColdCache *cache, size_t budget);
+void cold_cache_free(ColdCache *cache);
+void cold_cache_clear(ColdCache *cache);
+void cold_cache_reserve(ColdCache *cache, int p, int q, int id);
+void cold_cache_fill(ColdCache *cache, ColdEntry *entry);
+ColdEntry *cold_cache_take(ColdCache *cache, int p, int q);
+void cold_cache_remove(ColdCache *cache, int p, int q);
+void cold_cache_drop_mesh(ColdCache *cache, int p, int q);
+
+ColdEntry *cold_pack(
+    int p, int q, int id, Map *blocks, Map *lights, SignList *signs);
+void cold_pack_mesh(
+    ColdEntry *entry, float *data, int faces, int miny, int maxy);
+int cold_unpack(ColdEntry *entry, Map *blocks, Map *lights, SignList *signs);
+float *cold_unpack_mesh(ColdEntry *entry);
+void cold_entry_free(ColdEntry *entry);
+
+#endif
@@ -11,6 +11,8 @@
 #define MAX_MESSAGES 4
 #define DB_PATH "craft.db"
 #define USE_CACHE 1
+#define USE_BINARY_PROTOCOL 1
+#define USE_COMPRESSION 1
 #define DAY_LENGTH 600
 #define INVERT_MOUSE 0
 
@@ -50,5 +52,20 @@
 #define DELETE_CHUNK_RADIUS 14
 #define CHUNK_SIZE 32
 #define COMMIT_INTERVAL 5
+#define DB_READERS 4
+#define DB_CACHE_SIZE 8192
+#define DB_MMAP_SIZE (64 << 20)
+#define DB_STORAGE "rows"
+#define ONLINE_CACHE_SIZE (256 << 20)
+#define COLD_CACHE_SIZE (64 << 20)
+#define COLD_CACHE_MESHES 1
+#define PREFETCH_TIME 2.0
+#define PREFETCH_CHUNKS 2
+#define FRAME_BUDGET 0.004
+#define FRAME_SLICE 0.0005
+#define VIEW_FRAME_TIME (1.0 / 60)
+#define VIEW_MEMORY (512 << 20)
+#define VIEW_INTERVAL 1.0
+#define VIEW_HOLD 2
 
 #endif
@@ -1,9 +1,62 @@
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include "atomic.h"
+#include "blob.h"
+#include "config.h"
 #include "db.h"
+#include "region.h"
 #include "ring.h"
 #include "sqlite3.h"
+#include "storage.h"
 #include "tinycthread.h"
 
+#define BATCH_SIZE 64
+#define RING_SIZE 65536
+#define EVICT_BATCH 1024
+
+typedef struct {
+    sqlite3_stmt *single;
+    sqlite3_stmt *multiple;
+    int count;
+    int rows[BATCH_SIZE][6];
+} Batch;
+
+typedef struct {
+    int used;
+    int x;
+    int y;
+    int z;
+    int w;
+} PendingWrite;
+
+typedef struct {
+    int used;
+    RingEntryType type;
+    int p;
+    int q;
+    unsigned int mask;
+    unsigned int size;
+    PendingWrite *writes;
+} PendingChunk;
+
+typedef struct {
+    unsigned int mask;
+    unsigned int size;
+    PendingChunk *chunks;
+} PendingTable;
+
+typedef struct {
+    sqlite3 *db;
+    sqlite3_stmt *load_blocks_stmt;
+    sqlite3_stmt *load_lights_stmt;
+    sqlite3_stmt *load_signs_stmt;
+    sqlite3_stmt *range_blocks_stmt;
+    sqlite3_stmt *range_lights_stmt;
+    sqlite3_stmt *range_signs_stmt;
+    int busy;
+} Reader;
+
 static int db_enabled = 0;
 
 static sqlite3 *db;
@@ -12,17 +65,43 @@ static sqlite3_stmt *insert_light_stmt;
 static sqlite3_stmt *insert_sign_stmt;
 static sqlite3_stmt *delete_sign_stmt;
 static sqlite3_stmt *delete_signs_stmt;
-static sqlite3_stmt *load_blocks_stmt;
-static sqlite3_stmt *load_lights_stmt;
-static sqlite3_stmt *load_signs_stmt;
-static sqlite3_stmt *get_key_stmt;
+static sqlite3_stmt *delete_chunk_signs_stmt;
 static sqlite3_stmt *set_key_stmt;
+static sqlite3_stmt *access_stmt;
+static sqlite3_stmt *insert_blocks_stmt;
+static sqlite3_stmt *insert_lights_stmt;
+static sqlite3_stmt *get_blob_stmts[2];
+static sqlite3_stmt *set_blob_stmts[2];
 
-static Ring ring;
+static Reader readers[DB_READERS];
+static Storage *storage;
+static RegionStore regions;
+static int commit_count;
+static int cache_size;
+static int eviction_count;
+static int evictions[EVICT_BATCH][2];
+static int sign_changes;
+static Batch block_batch;
+static Batch light_batch;
+static PendingTable pending;
+static PendingTable flushing;
+static int rows_written;
+static int rows_saved;
+static int auth_unknown;
+static int auth_result;
+static char auth_username[128];
+static char auth_identity_token[128];
+static float state[5];
+static int write_count;
+static int write_saved;
+static double write_time;
+
+static SpscRing ring;
+static int waiting;
 static thrd_t thrd;
 static mtx_t mtx;
 static cnd_t cnd;
-static mtx_t load_mtx;
+static mtx_t pending_mtx;
 
 void db_enable() {
     db_enabled = 1;
@@ -36,6 +115,613 @@ int get_db_enabled() {
     return db_enabled;
 }
 
+static int db_prepare_batch(const char *table, sqlite3_stmt **stmt) {
+    static const char *row = "(?, ?, ?, ?, ?, ?)";
+    char query[64 + 20 * BATCH_SIZE];
+    int length = snprintf(query, sizeof(query),
+        "insert or replace into %s (p, q, x, y, z, w) values ", table);
+    for (int i = 0; i < BATCH_SIZE; i++) {
+        length += snprintf(query + length, sizeof(query) - length,
+            "%s%s", i ? ", " : "", row);
+    }
+    return sqlite3_prepare_v2(db, query, -1, stmt, NULL);
+}
+
+static void batch_flush(Batch *batch) {
+    if (batch->count == BATCH_SIZE) {
+        sqlite3_stmt *stmt = batch->multiple;
+        sqlite3_reset(stmt);
+        for (int i = 0; i < BATCH_SIZE; i++) {
+            for (int j = 0; j < 6; j++) {
+                sqlite3_bind_int(stmt, i * 6 + j + 1, batch->rows[i][j]);
+            }
+        }
+        sqlite3_step(stmt);
+    }
+    else {
+        sqlite3_stmt *stmt = batch->single;
+        for (int i = 0; i < batch->count; i++) {
+            sqlite3_reset(stmt);
+            for (int j = 0; j < 6; j++) {
+                sqlite3_bind_int(stmt, j + 1, batch->rows[i][j]);
+            }
+            sqlite3_step(stmt);
+        }
+    }
+    batch->count = 0;
+}
+
+static void batch_add(
+    Batch *batch, int p, int q, int x, int y, int z, int w)
+{
+    int *row = batch->rows[batch->count++];
+    row[0] = p; row[1] = q; row[2] = x; row[3] = y; row[4] = z; row[5] = w;
+    if (batch->count == BATCH_SIZE) {
+        batch_flush(batch);
+    }
+}
+
+// Block and light writes wait in the pending table until the next commit,
+// one open addressed table of writes per chunk and layer so that loads
+// only look at their own chunk. At commit the table is swapped with the
+// empty flushing one, which is written out without holding pending_mtx.
+// Loads overlay both, flushing first, until the commit has gone through.
+
+static void pending_alloc(PendingTable *table, unsigned int mask) {
+    table->mask = mask;
+    table->size = 0;
+    table->chunks = (PendingChunk *)calloc(mask + 1, sizeof(PendingChunk));
+}
+
+static void pending_free(PendingTable *table) {
+    for (unsigned int i = 0; i <= table->mask; i++) {
+        free(table->chunks[i].writes);
+    }
+    free(table->chunks);
+}
+
+static PendingChunk *pending_find(
+    PendingTable *table, RingEntryType type, int p, int q)
+{
+    // the chunk's entry, or the empty slot where it belongs
+    unsigned int index = hash(p, q, type) & table->mask;
+    PendingChunk *chunk = table->chunks + index;
+    while (chunk->used) {
+        if (chunk->type == type && chunk->p == p && chunk->q == q) {
+            break;
+        }
+        index = (index + 1) & table->mask;
+        chunk = table->chunks + index;
+    }
+    return chunk;
+}
+
+static PendingChunk *pending_chunk(
+    PendingTable *table, RingEntryType type, int p, int q)
+{
+    PendingChunk *chunk = pending_find(table, type, p, q);
+    if (chunk->used) {
+        return chunk;
+    }
+    if ((table->size + 1) * 2 > table->mask) {
+        PendingTable old = *table;
+        pending_alloc(table, (old.mask << 1) | 1);
+        for (unsigned int i = 0; i <= old.mask; i++) {
+            PendingChunk *other = old.chunks + i;
+            if (other->used) {
+                *pending_find(table, other->type, other->p, other->q) =
+                    *other;
+                table->size++;
+            }
+        }
+        free(old.chunks);
+        chunk = pending_find(table, type, p, q);
+    }
+    chunk->used = 1;
+    chunk->type = type;
+    chunk->p = p;
+    chunk->q = q;
+    chunk->mask = 255;
+    chunk->size = 0;
+    chunk->writes = (PendingWrite *)calloc(256, sizeof(PendingWrite));
+    table->size++;
+    return chunk;
+}
+
+static void pending_set(PendingChunk *chunk, int x, int y, int z, int w) {
+    unsigned int index = hash(x, y, z) & chunk->mask;
+    PendingWrite *entry = chunk->writes + index;
+    while (entry->used) {
+        if (entry->x == x && entry->y == y && entry->z == z) {
+            entry->w = w;
+            rows_saved++;
+            return;
+        }
+        index = (index + 1) & chunk->mask;
+        entry = chunk->writes + index;
+    }
+    entry->used = 1;
+    entry->x = x;
+    entry->y = y;
+    entry->z = z;
+    entry->w = w;
+    chunk->size++;
+    if (chunk->size * 2 > chunk->mask) {
+        PendingWrite *data = chunk->writes;
+        unsigned int mask = chunk->mask;
+        chunk->mask = (mask << 1) | 1;
+        chunk->size = 0;
+        chunk->writes =
+            (PendingWrite *)calloc(chunk->mask + 1, sizeof(PendingWrite));
+        for (unsigned int i = 0; i <= mask; i++) {
+            PendingWrite *other = data + i;
+            if (other->used) {
+                pending_set(chunk, other->x, other->y, other->z, other->w);
+            }
+        }
+        free(data);
+    }
+}
+
+static void pending_retry(PendingChunk *e) {
+    // called with pending_mtx held, puts the writes of a chunk that could
+    // not be saved back for the next commit unless newer ones replaced them
+    PendingChunk *chunk = pending_chunk(&pending, e->type, e->p, e->q);
+    for (unsigned int i = 0; i <= e->mask; i++) {
+        PendingWrite *f = e->writes + i;
+        if (!f->used) {
+            continue;
+        }
+        unsigned int index = hash(f->x, f->y, f->z) & chunk->mask;
+        PendingWrite *entry = chunk->writes + index;
+        while (entry->used) {
+            if (entry->x == f->x && entry->y == f->y && entry->z == f->z) {
+                break;
+            }
+            index = (index + 1) & chunk->mask;
+            entry = chunk->writes + index;
+        }
+        if (!entry->used) {
+            pending_set(chunk, f->x, f->y, f->z, f->w);
+        }
+    }
+}
+
+static void pending_put(RingEntry *e) {
+    mtx_lock(&pending_mtx);
+    PendingChunk *chunk = pending_chunk(&pending, e->type, e->p, e->q);
+    pending_set(chunk, e->x, e->y, e->z, e->w);
+    mtx_unlock(&pending_mtx);
+}
+
+static int pending_compare(const void *a, const void *b) {
+    const PendingChunk *e1 = (const PendingChunk *)a;
+    const PendingChunk *e2 = (const PendingChunk *)b;
+    if (e1->type != e2->type) return e1->type - e2->type;
+    if (e1->p != e2->p) return e1->p < e2->p ? -1 : 1;
+    if (e1->q != e2->q) return e1->q < e2->q ? -1 : 1;
+    return 0;
+}
+
+static void pending_flush() {
+    // hands the pending writes to the storage one chunk at a time, in
+    // (p, q, x, y, z) order as hash order scatters them all over the index
+    mtx_lock(&pending_mtx);
+    PendingTable table = flushing;
+    flushing = pending;
+    pending = table;
+    mtx_unlock(&pending_mtx);
+    int count = flushing.size;
+    PendingChunk *chunks =
+        (PendingChunk *)malloc(sizeof(PendingChunk) * (count + 1));
+    for (unsigned int i = 0, n = 0; i <= flushing.mask; i++) {
+        if (flushing.chunks[i].used) {
+            chunks[n++] = flushing.chunks[i];
+        }
+    }
+    qsort(chunks, count, sizeof(PendingChunk), pending_compare);
+    for (int i = 0; i < count; i++) {
+        PendingChunk *e = chunks + i;
+        Voxel *voxels = (Voxel *)malloc(sizeof(Voxel) * (e->size + 1));
+        int n = 0;
+        for (unsigned int j = 0; j <= e->mask; j++) {
+            PendingWrite *f = e->writes + j;
+            if (f->used) {
+                voxels[n].key = blob_key(e->p, e->q, f->x, f->y, f->z);
+                voxels[n++].w = f->w;
+            }
+        }
+        blob_sort(voxels, n);
+        int layer = e->type == BLOCK ? STORAGE_BLOCKS : STORAGE_LIGHTS;
+        if (storage->save(layer, e->p, e->q, voxels, n)) {
+            mtx_lock(&pending_mtx);
+            pending_retry(e);
+            mtx_unlock(&pending_mtx);
+        }
+        else {
+            rows_written += n;
+        }
+        free(voxels);
+    }
+    free(chunks);
+    storage->commit();
+}
+
+static void pending_committed() {
+    // the flushed writes are visible to new snapshots, loads that started
+    // before retry
+    mtx_lock(&pending_mtx);
+    ATOMIC_ADD(&commit_count, 1);
+    pending_free(&flushing);
+    pending_alloc(&flushing, 255);
+    mtx_unlock(&pending_mtx);
+}
+
+static void pending_load(Map *map, RingEntryType type, int p, int q) {
+    // called with pending_mtx held
+    PendingTable *tables[2] = {&flushing, &pending};
+    for (int i = 0; i < 2; i++) {
+        PendingChunk *chunk = pending_find(tables[i], type, p, q);
+        if (!chunk->used) {
+            continue;
+        }
+        for (unsigned int j = 0; j <= chunk->mask; j++) {
+            PendingWrite *e = chunk->writes + j;
+            if (e->used) {
+                map_set(map, e->x, e->y, e->z, e->w);
+            }
+        }
+    }
+}
+
+static int db_pragmas(sqlite3 *conn) {
+    char query[256];
+    snprintf(query, sizeof(query),
+        "pragma cache_size = -%d; pragma mmap_size = %lld;",
+        DB_CACHE_SIZE, (long long)DB_MMAP_SIZE);
+    sqlite3_busy_timeout(conn, 1000);
+    return sqlite3_exec(conn, query, NULL, NULL, NULL);
+}
+
+static int reader_open(Reader *reader, char *path, int blobs) {
+    const char *load_blocks_query =
+        "select x, y, z, w from block where p = ? and q = ?;";
+    const char *load_lights_query =
+        "select x, y, z, w from light where p = ? and q = ?;";
+    static const char *load_signs_query =
+        "select x, y, z, face, text from sign where p = ? and q = ?;";
+    const char *range_blocks_query =
+        "select p, q, x, y, z, w from block "
+        "where p between ? and ? and q between ? and ?;";
+    const char *range_lights_query =
+        "select p, q, x, y, z, w from light "
+        "where p between ? and ? and q between ? and ?;";
+    static const char *load_block_blob_query =
+        "select data from block_blob where p = ? and q = ?;";
+    static const char *load_light_blob_query =
+        "select data from light_blob where p = ? and q = ?;";
+    static const char *range_block_blobs_query =
+        "select p, q, data from block_blob "
+        "where p between ? and ? and q between ? and ?;";
+    static const char *range_light_blobs_query =
+        "select p, q, data from light_blob "
+        "where p between ? and ? and q between ? and ?;";
+    if (blobs) {
+        load_blocks_query = load_block_blob_query;
+        load_lights_query = load_light_blob_query;
+        range_blocks_query = range_block_blobs_query;
+        range_lights_query = range_light_blobs_query;
+    }
+    static const char *range_signs_query =
+        "select p, q, x, y, z, face, text from sign "
+        "where p between ? and ? and q between ? and ?;";
+
+    int rc;
+    reader->busy = 0;
+    rc = sqlite3_open_v2(path, &reader->db, SQLITE_OPEN_READONLY, NULL);
+    if (rc) return rc;
+    rc = db_pragmas(reader->db);
+    if (rc) return rc;
+    rc = sqlite3_prepare_v2(reader->db, load_blocks_query, -1,
+        &reader->load_blocks_stmt, NULL);
+    if (rc) return rc;
+    rc = sqlite3_prepare_v2(reader->db, load_lights_query, -1,
+        &reader->load_lights_stmt, NULL);
+    if (rc) return rc;
+    rc = sqlite3_prepare_v2(reader->db, load_signs_query, -1,
+        &reader->load_signs_stmt, NULL);
+    if (rc) return rc;
+    rc = sqlite3_prepare_v2(reader->db, range_blocks_query, -1,
+        &reader->range_blocks_stmt, NULL);
+    if (rc) return rc;
+    rc = sqlite3_prepare_v2(reader->db, range_lights_query, -1,
+        &reader->range_lights_stmt, NULL);
+    if (rc) return rc;
+    rc = sqlite3_prepare_v2(reader->db, range_signs_query, -1,
+        &reader->range_signs_stmt, NULL);
+    if (rc) return rc;
+    return 0;
+}
+
+static void reader_close(Reader *reader) {
+    sqlite3_finalize(reader->load_blocks_stmt);
+    sqlite3_finalize(reader->load_lights_stmt);
+    sqlite3_finalize(reader->load_signs_stmt);
+    sqlite3_finalize(reader->range_blocks_stmt);
+    sqlite3_finalize(reader->range_lights_stmt);
+    sqlite3_finalize(reader->range_signs_stmt);
+    sqlite3_close(reader->db);
+}
+
+static Reader *reader_claim() {
+    while (1) {
+        for (int i = 0; i < DB_READERS; i++) {
+            int expected = 0;
+            if (ATOMIC_CAS(&readers[i].busy, &expected, 1)) {
+                return readers + i;
+            }
+        }
+        thrd_yield();
+    }
+}
+
+static void reader_release(Reader *reader) {
+    ATOMIC_STORE(&reader->busy, 0);
+}
+
+static void db_range_query(
+    sqlite3_stmt *stmt, int p0, int q0, int p1, int q1)
+{
+    sqlite3_reset(stmt);
+    sqlite3_bind_int(stmt, 1, p0);
+    sqlite3_bind_int(stmt, 2, p1);
+    sqlite3_bind_int(stmt, 3, q0);
+    sqlite3_bind_int(stmt, 4, q1);
+}
+
+static void map_set_voxels(Map *map, int p, int q, Voxel *voxels, int count) {
+    for (int i = 0; i < count; i++) {
+        int x, y, z;
+        blob_position(p, q, voxels[i].key, &x, &y, &z);
+        map_set(map, x, y, z, voxels[i].w);
+    }
+}
+
+static void map_set_blob(
+    Map *map, int p, int q, sqlite3_stmt *stmt, int column)
+{
+    int count;
+    Voxel *voxels = blob_decode(sqlite3_column_blob(stmt, column),
+        sqlite3_column_bytes(stmt, column), &count);
+    map_set_voxels(map, p, q, voxels, count);
+    free(voxels);
+}
+
+static void map_set_row(Map *map, sqlite3_stmt *stmt, int column) {
+    int x = sqlite3_column_int(stmt, column);
+    int y = sqlite3_column_int(stmt, column + 1);
+    int z = sqlite3_column_int(stmt, column + 2);
+    int w = sqlite3_column_int(stmt, column + 3);
+    map_set(map, x, y, z, w);
+}
+
+static void db_range_maps(
+    sqlite3_stmt *stmt, int blobs, Map **maps,
+    int p0, int q0, int p1, int q1)
+{
+    int n = q1 - q0 + 1;
+    db_range_query(stmt, p0, q0, p1, q1);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        int p = sqlite3_column_int(stmt, 0);
+        int q = sqlite3_column_int(stmt, 1);
+        Map *map = maps[(p - p0) * n + (q - q0)];
+        if (map && blobs) {
+            map_set_blob(map, p, q, stmt, 2);
+        }
+        else if (map) {
+            map_set_row(map, stmt, 2);
+        }
+    }
+    sqlite3_reset(stmt);
+}
+
+// rows: one row per block in the block and light tables
+
+static int sqlite_open(char *path) {
+    // the tables live in the main database, which is already open
+    (void)path;
+    return 0;
+}
+
+static void sqlite_close() {
+}
+
+static int sqlite_size() {
+    return 0;
+}
+
+static void db_delete_chunk(const char *table, int p, int q) {
+    char query[128];
+    snprintf(query, sizeof(query),
+        "delete from %s where p = %d and q = %d;", table, p, q);
+    sqlite3_exec(db, query, NULL, NULL, NULL);
+}
+
+static int rows_save(int layer, int p, int q, Voxel *voxels, int count) {
+    // keys are (y, z, x), the unique index wants (x, y, z) order
+    Batch *batch = layer == STORAGE_BLOCKS ? &block_batch : &light_batch;
+    Voxel *rows = (Voxel *)malloc(sizeof(Voxel) * (count + 1));
+    for (int i = 0; i < count; i++) {
+        int key = voxels[i].key;
+        rows[i].key = ((key & 0xff) << 16) | (key >> 8 & 0xff00) |
+            (key >> 8 & 0xff);
+        rows[i].w = voxels[i].w;
+    }
+    blob_sort(rows, count);
+    for (int i = 0; i < count; i++) {
+        int key = rows[i].key;
+        int x = (key >> 16) + p * CHUNK_SIZE - 1;
+        int y = key >> 8 & 0xff;
+        int z = (key & 0xff) + q * CHUNK_SIZE - 1;
+        batch_add(batch, p, q, x, y, z, rows[i].w);
+    }
+    free(rows);
+    return 0;
+}
+
+static void rows_remove(int p, int q) {
+    db_delete_chunk("block", p, q);
+    db_delete_chunk("light", p, q);
+}
+
+static void rows_commit() {
+    batch_flush(&block_batch);
+    batch_flush(&light_batch);
+}
+
+static void rows_load(int layer, int p, int q, Map *map) {
+    Reader *reader = reader_claim();
+    sqlite3_stmt *stmt = layer == STORAGE_BLOCKS ?
+        reader->load_blocks_stmt : reader->load_lights_stmt;
+    sqlite3_reset(stmt);
+    sqlite3_bind_int(stmt, 1, p);
+    sqlite3_bind_int(stmt, 2, q);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        map_set_row(map, stmt, 0);
+    }
+    sqlite3_reset(stmt);
+    reader_release(reader);
+}
+
+static void rows_load_range(
+    int layer, int p0, int q0, int p1, int q1, Map **maps)
+{
+    Reader *reader = reader_claim();
+    sqlite3_stmt *stmt = layer == STORAGE_BLOCKS ?
+        reader->range_blocks_stmt : reader->range_lights_stmt;
+    db_range_maps(stmt, 0, maps, p0, q0, p1, q1);
+    reader_release(reader);
+}
+
+// blobs: one blob per chunk in the block_blob and light_blob tables
+
+static int blobs_save(int layer, int p, int q, Voxel *voxels, int count) {
+    Voxel *stored = 0;
+    int stored_count = 0;
+    sqlite3_stmt *stmt = get_blob_stmts[layer];
+    sqlite3_reset(stmt);
+    sqlite3_bind_int(stmt, 1, p);
+    sqlite3_bind_int(stmt, 2, q);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        stored = blob_decode(sqlite3_column_blob(stmt, 0),
+            sqlite3_column_bytes(stmt, 0), &stored_count);
+    }
+    sqlite3_reset(stmt);
+    int merged_count;
+    Voxel *merged = blob_merge(
+        stored, stored_count, voxels, count, &merged_count);
+    int size;
+    unsigned char *data = blob_encode(merged, merged_count, &size);
+    stmt = set_blob_stmts[layer];
+    sqlite3_reset(stmt);
+    sqlite3_bind_int(stmt, 1, p);
+    sqlite3_bind_int(stmt, 2, q);
+    sqlite3_bind_blob(stmt, 3, data, size, SQLITE_TRANSIENT);
+    sqlite3_step(stmt);
+    free(stored);
+    free(merged);
+    free(data);
+    return 0;
+}
+
+static void blobs_remove(int p, int q) {
+    db_delete_chunk("block_blob", p, q);
+    db_delete_chunk("light_blob", p, q);
+}
+
+static void blobs_commit() {
+}
+
+static void blobs_load(int layer, int p, int q, Map *map) {
+    Reader *reader = reader_claim();
+    sqlite3_stmt *stmt = layer == STORAGE_BLOCKS ?
+        reader->load_blocks_stmt : reader->load_lights_stmt;
+    sqlite3_reset(stmt);
+    sqlite3_bind_int(stmt, 1, p);
+    sqlite3_bind_int(stmt, 2, q);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        map_set_blob(map, p, q, stmt, 0);
+    }
+    sqlite3_reset(stmt);
+    reader_release(reader);
+}
+
+static void blobs_load_range(
+    int layer, int p0, int q0, int p1, int q1, Map **maps)
+{
+    Reader *reader = reader_claim();
+    sqlite3_stmt *stmt = layer == STORAGE_BLOCKS ?
+        reader->range_blocks_stmt : reader->range_lights_stmt;
+    db_range_maps(stmt, 1, maps, p0, q0, p1, q1);
+    reader_release(reader);
+}
+
+// regions: memory mapped region files next to the database
+
+static int regions_open(char *path) {
+    char dir[256];
+    snprintf(dir, sizeof(dir), "%s.regions", path);
+    return region_store_open(&regions, dir);
+}
+
+static void regions_close() {
+    region_store_close(&regions);
+}
+
+static int regions_save(int layer, int p, int q, Voxel *voxels, int count) {
+    return region_store_save(&regions, layer, p, q, voxels, count);
+}
+
+static void regions_remove(int p, int q) {
+    region_store_clear(&regions, p, q);
+}
+
+static void regions_commit() {
+    region_store_commit(&regions);
+}
+
+static void regions_load(int layer, int p, int q, Map *map) {
+    int count;
+    Voxel *voxels = region_store_load(&regions, layer, p, q, &count);
+    map_set_voxels(map, p, q, voxels, count);
+    free(voxels);
+}
+
+static int regions_size() {
+    return region_store_size(&regions, 1);
+}
+
+static Storage storages[] = {
+    {"rows", sqlite_open, sqlite_close, rows_save, rows_remove,
+        rows_commit, rows_load, rows_load_range, sqlite_size},
+    {"blobs", sqlite_open, sqlite_close, blobs_save, blobs_remove,
+        blobs_commit, blobs_load, blobs_load_range, sqlite_size},
+    {"regions", regions_open, regions_close, regions_save, regions_remove,
+        regions_commit, regions_load, 0, regions_size},
+};
+
+int db_set_storage(const char *name) {
+    // selects where blocks and lights are kept, must precede db_init
+    int count = sizeof(storages) / sizeof(Storage);
+    for (int i = 0; i < count; i++) {
+        if (strcmp(storages[i].name, name) == 0) {
+            storage = storages + i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
 int db_init(char *path) {
     if (!db_enabled) {
         return 0;
@@ -75,7 +761,13 @@ int db_init(char *path) {
         "create table if not exists key ("
         "    p int not null,"
         "    q int not null,"
-        "    key int not null"
+        "    key int not null,"
+        "    sign_key int not null default 0"
+        ");"
+        "create table if not exists access ("
+        "    p int not null,"
+        "    q int not null,"
+        "    time int not null"
         ");"
         "create table if not exists sign ("
         "    p int not null,"
@@ -86,9 +778,23 @@ int db_init(char *path) {
         "    face int not null,"
         "    text text not null"
         ");"
+        "create table if not exists block_blob ("
+        "    p int not null,"
+        "    q int not null,"
+        "    data blob not null"
+        ");"
+        "create table if not exists light_blob ("
+        "    p int not null,"
+        "    q int not null,"
+        "    data blob not null"
+        ");"
+        "create unique index if not exists block_blob_pq_idx on block_blob (p, q);"
+        "create unique index if not exists light_blob_pq_idx on light_blob (p, q);"
         "create unique index if not exists block_pqxyz_idx on block (p, q, x, y, z);"
         "create unique index if not exists light_pqxyz_idx on light (p, q, x, y, z);"
         "create unique index if not exists key_pq_idx on key (p, q);"
+        "create unique index if not exists access_pq_idx on access (p, q);"
+        "create index if not exists access_time_idx on access (time);"
         "create unique index if not exists sign_xyzface_idx on sign (x, y, z, face);"
         "create index if not exists sign_pq_idx on sign (p, q);";
     static const char *insert_block_query =
@@ -104,22 +810,38 @@ int db_init(char *path) {
         "delete from sign where x = ? and y = ? and z = ? and face = ?;";
     static const char *delete_signs_query =
         "delete from sign where x = ? and y = ? and z = ?;";
-    static const char *load_blocks_query =
-        "select x, y, z, w from block where p = ? and q = ?;";
-    static const char *load_lights_query =
-        "select x, y, z, w from light where p = ? and q = ?;";
-    static const char *load_signs_query =
-        "select x, y, z, face, text from sign where p = ? and q = ?;";
-    static const char *get_key_query =
-        "select key from key where p = ? and q = ?;";
     static const char *set_key_query =
-        "insert or replace into key (p, q, key) "
-        "values (?, ?, ?);";
+        "insert or replace into key (p, q, key, sign_key) "
+        "values (?, ?, ?, ?);";
+    static const char *delete_chunk_signs_query =
+        "delete from sign where p = ? and q = ?;";
+    static const char *access_query =
+        "insert or replace into access (p, q, time) values (?, ?, ?);";
     int rc;
     rc = sqlite3_open(path, &db);
     if (rc) return rc;
+    // wal lets the chunk loaders read while the writer thread holds
+    // its long running transaction
+    rc = sqlite3_exec(db,
+        "pragma journal_mode = wal; pragma synchronous = normal;",
+        NULL, NULL, NULL);
+    if (rc) return rc;
+    rc = db_pragmas(db);
+    if (rc) return rc;
     rc = sqlite3_exec(db, create_query, NULL, NULL, NULL);
     if (rc) return rc;
+    // key tables from before signs were versioned, fails once migrated
+    sqlite3_exec(db,
+        "alter table key add column sign_key int not null default 0;",
+        NULL, NULL, NULL);
+    if (cache_size) {
+        // cached chunks from before access was tracked are the oldest
+        sqlite3_exec(db,
+            "insert or ignore into access (p, q, time) "
+            "select p, q, 0 from key;",
+            NULL, NULL, NULL);
+    }
+    ATOMIC_STORE(&eviction_count, 0);
     rc = sqlite3_prepare_v2(
         db, insert_block_query, -1, &insert_block_stmt, NULL);
     if (rc) return rc;
@@ -135,16 +857,54 @@ int db_init(char *path) {
     rc = sqlite3_prepare_v2(
         db, delete_signs_query, -1, &delete_signs_stmt, NULL);
     if (rc) return rc;
-    rc = sqlite3_prepare_v2(db, load_blocks_query, -1, &load_blocks_stmt, NULL);
+    rc = sqlite3_prepare_v2(db, set_key_query, -1, &set_key_stmt, NULL);
+    if (rc) return rc;
+    rc = sqlite3_prepare_v2(
+        db, delete_chunk_signs_query, -1, &delete_chunk_signs_stmt, NULL);
     if (rc) return rc;
-    rc = sqlite3_prepare_v2(db, load_lights_query, -1, &load_lights_stmt, NULL);
+    rc = sqlite3_prepare_v2(db, access_query, -1, &access_stmt, NULL);
     if (rc) return rc;
-    rc = sqlite3_prepare_v2(db, load_signs_query, -1, &load_signs_stmt, NULL);
+    rc = sqlite3_prepare_v2(db,
+        "select data from block_blob where p = ? and q = ?;",
+        -1, get_blob_stmts, NULL);
     if (rc) return rc;
-    rc = sqlite3_prepare_v2(db, get_key_query, -1, &get_key_stmt, NULL);
+    rc = sqlite3_prepare_v2(db,
+        "select data from light_blob where p = ? and q = ?;",
+        -1, get_blob_stmts + 1, NULL);
     if (rc) return rc;
-    rc = sqlite3_prepare_v2(db, set_key_query, -1, &set_key_stmt, NULL);
+    rc = sqlite3_prepare_v2(db,
+        "insert or replace into block_blob (p, q, data) values (?, ?, ?);",
+        -1, set_blob_stmts, NULL);
+    if (rc) return rc;
+    rc = sqlite3_prepare_v2(db,
+        "insert or replace into light_blob (p, q, data) values (?, ?, ?);",
+        -1, set_blob_stmts + 1, NULL);
+    if (rc) return rc;
+    rc = db_prepare_batch("block", &insert_blocks_stmt);
+    if (rc) return rc;
+    rc = db_prepare_batch("light", &insert_lights_stmt);
     if (rc) return rc;
+    block_batch.single = insert_block_stmt;
+    block_batch.multiple = insert_blocks_stmt;
+    block_batch.count = 0;
+    light_batch.single = insert_light_stmt;
+    light_batch.multiple = insert_lights_stmt;
+    light_batch.count = 0;
+    if (!storage && db_set_storage(DB_STORAGE)) {
+        storage = storages;
+    }
+    for (int i = 0; i < DB_READERS; i++) {
+        rc = reader_open(readers + i, path, storage->load == blobs_load);
+        if (rc) return rc;
+    }
+    rc = storage->open(path);
+    if (rc) return rc;
+    commit_count = 0;
+    write_count = 0;
+    write_saved = 0;
+    write_time = 0;
+    auth_unknown = 0;
+    auth_result = DB_AUTH_NONE;
     sqlite3_exec(db, "begin;", NULL, NULL, NULL);
     db_worker_start();
     return 0;
@@ -155,17 +915,25 @@ void db_close() {
         return;
     }
     db_worker_stop();
+    storage->close();
     sqlite3_exec(db, "commit;", NULL, NULL, NULL);
     sqlite3_finalize(insert_block_stmt);
     sqlite3_finalize(insert_light_stmt);
     sqlite3_finalize(insert_sign_stmt);
     sqlite3_finalize(delete_sign_stmt);
     sqlite3_finalize(delete_signs_stmt);
-    sqlite3_finalize(load_blocks_stmt);
-    sqlite3_finalize(load_lights_stmt);
-    sqlite3_finalize(load_signs_stmt);
-    sqlite3_finalize(get_key_stmt);
+    sqlite3_finalize(delete_chunk_signs_stmt);
     sqlite3_finalize(set_key_stmt);
+    sqlite3_finalize(access_stmt);
+    sqlite3_finalize(insert_blocks_stmt);
+    sqlite3_finalize(insert_lights_stmt);
+    for (int i = 0; i < 2; i++) {
+        sqlite3_finalize(get_blob_stmts[i]);
+        sqlite3_finalize(set_blob_stmts[i]);
+    }
+    for (int i = 0; i < DB_READERS; i++) {
+        reader_close(readers + i);
+    }
     sqlite3_close(db);
 }
 
@@ -173,20 +941,135 @@ void db_commit() {
     if (!db_enabled) {
         return;
     }
-    mtx_lock(&mtx);
-    ring_put_commit(&ring);
-    cnd_signal(&cnd);
-    mtx_unlock(&mtx);
+    RingEntry e = {COMMIT};
+    spsc_put(&ring, &e);
+    db_flush();
+}
+
+int db_flush() {
+    if (!db_enabled) {
+        return 0;
+    }
+    if (sign_changes) {
+        // the worker writes signs straight to its connection, the readers
+        // only see them once committed
+        RingEntry e = {COMMIT};
+        spsc_put(&ring, &e);
+        sign_changes = 0;
+    }
+    int result = spsc_publish(&ring);
+    // pairs with the fence in db_worker_run so that either the worker
+    // sees the new entries or we see that it is waiting
+    ATOMIC_FENCE();
+    if (ATOMIC_LOAD(&waiting)) {
+        mtx_lock(&mtx);
+        cnd_signal(&cnd);
+        mtx_unlock(&mtx);
+    }
+    return result;
+}
+
+static sqlite3_int64 db_pragma(const char *name) {
+    char query[64];
+    snprintf(query, sizeof(query), "pragma %s;", name);
+    sqlite3_int64 result = 0;
+    sqlite3_stmt *stmt;
+    sqlite3_prepare_v2(db, query, -1, &stmt, NULL);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        result = sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    return result;
+}
+
+static void db_propose_evictions() {
+    // the least recently requested chunks are handed to the main thread,
+    // which drops their keys before it lets us delete them
+    if (!cache_size || ATOMIC_LOAD(&eviction_count)) {
+        return;
+    }
+    sqlite3_int64 used = db_pragma("page_count") - db_pragma("freelist_count");
+    used = used * db_pragma("page_size") + storage->size();
+    if (used <= cache_size) {
+        return;
+    }
+    sqlite3_stmt *stmt;
+    sqlite3_prepare_v2(db, "select count(*) from access;", -1, &stmt, NULL);
+    sqlite3_int64 chunks = 0;
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        chunks = sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    if (!chunks) {
+        return;
+    }
+    // aim a tenth below the limit so this does not run on every commit
+    sqlite3_int64 excess = used - cache_size + cache_size / 10;
+    sqlite3_int64 count = excess / (used / chunks + 1) + 1;
+    if (count > EVICT_BATCH) {
+        count = EVICT_BATCH;
+    }
+    sqlite3_prepare_v2(db,
+        "select p, q from access order by time limit ?;", -1, &stmt, NULL);
+    sqlite3_bind_int64(stmt, 1, count);
+    int n = 0;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        evictions[n][0] = sqlite3_column_int(stmt, 0);
+        evictions[n][1] = sqlite3_column_int(stmt, 1);
+        n++;
+    }
+    sqlite3_finalize(stmt);
+    ATOMIC_STORE(&eviction_count, n);
 }
 
 void _db_commit() {
+    pending_flush();
     sqlite3_exec(db, "commit; begin;", NULL, NULL, NULL);
+    pending_committed();
+    db_propose_evictions();
+}
+
+void db_write_stats(int *count, int *saved, double *seconds) {
+    if (!db_enabled) {
+        *count = 0;
+        *saved = 0;
+        *seconds = 0;
+        return;
+    }
+    mtx_lock(&mtx);
+    *count = write_count;
+    *saved = write_saved;
+    *seconds = write_time;
+    write_count = 0;
+    write_saved = 0;
+    write_time = 0;
+    mtx_unlock(&mtx);
+}
+
+static char *copy_text(const char *a, const char *b) {
+    // b, if given, is stored after the terminator of a
+    size_t n = strlen(a) + 1;
+    size_t m = b ? strlen(b) + 1 : 0;
+    char *result = (char *)malloc(n + m);
+    memcpy(result, a, n);
+    if (b) {
+        memcpy(result + n, b, m);
+    }
+    return result;
 }
 
 void db_auth_set(char *username, char *identity_token) {
     if (!db_enabled) {
         return;
     }
+    RingEntry e = {AUTH_SET};
+    e.data = copy_text(username, identity_token);
+    spsc_put(&ring, &e);
+}
+
+static void _db_auth_select(char *username);
+
+static void _db_auth_set(char *username, char *identity_token) {
     static const char *query =
         "insert or replace into auth.identity_token "
         "(username, token, selected) values (?, ?, ?);";
@@ -197,14 +1080,26 @@ void db_auth_set(char *username, char *identity_token) {
     sqlite3_bind_int(stmt, 3, 1);
     sqlite3_step(stmt);
     sqlite3_finalize(stmt);
-    db_auth_select(username);
+    _db_auth_select(username);
 }
 
-int db_auth_select(char *username) {
+void db_auth_select(char *username) {
     if (!db_enabled) {
-        return 0;
+        return;
     }
-    db_auth_select_none();
+    RingEntry e = {AUTH_SELECT};
+    e.data = copy_text(username, 0);
+    spsc_put(&ring, &e);
+}
+
+static void _db_auth_select_none() {
+    sqlite3_exec(db, "update auth.identity_token set selected = 0;",
+        NULL, NULL, NULL);
+    auth_unknown = 0;
+}
+
+static void _db_auth_select(char *username) {
+    _db_auth_select_none();
     static const char *query =
         "update auth.identity_token set selected = 1 where username = ?;";
     sqlite3_stmt *stmt;
@@ -212,15 +1107,15 @@ int db_auth_select(char *username) {
     sqlite3_bind_text(stmt, 1, username, -1, NULL);
     sqlite3_step(stmt);
     sqlite3_finalize(stmt);
-    return sqlite3_changes(db);
+    auth_unknown = !sqlite3_changes(db);
 }
 
 void db_auth_select_none() {
     if (!db_enabled) {
         return;
     }
-    sqlite3_exec(db, "update auth.identity_token set selected = 0;",
-        NULL, NULL, NULL);
+    RingEntry e = {AUTH_SELECT_NONE};
+    spsc_put(&ring, &e);
 }
 
 int db_auth_get(
@@ -247,13 +1142,10 @@ int db_auth_get(
     return result;
 }
 
-int db_auth_get_selected(
+static int _db_auth_get_selected(
     char *username, int username_length,
     char *identity_token, int identity_token_length)
 {
-    if (!db_enabled) {
-        return 0;
-    }
     static const char *query =
         "select username, token from auth.identity_token "
         "where selected = 1;";
@@ -273,20 +1165,86 @@ int db_auth_get_selected(
     return result;
 }
 
+void db_auth_login() {
+    // the selected identity is looked up after the queued auth changes,
+    // the answer is picked up with db_auth_result
+    if (!db_enabled) {
+        auth_result = DB_AUTH_ANONYMOUS;
+        return;
+    }
+    RingEntry e = {AUTH_LOGIN};
+    spsc_put(&ring, &e);
+}
+
+static void _db_auth_login() {
+    char username[128] = {0};
+    char identity_token[128] = {0};
+    int result = DB_AUTH_ANONYMOUS;
+    if (auth_unknown) {
+        result = DB_AUTH_UNKNOWN;
+    }
+    else if (_db_auth_get_selected(
+        username, 128, identity_token, 128))
+    {
+        result = DB_AUTH_SELECTED;
+    }
+    auth_unknown = 0;
+    mtx_lock(&mtx);
+    auth_result = result;
+    memcpy(auth_username, username, 128);
+    memcpy(auth_identity_token, identity_token, 128);
+    mtx_unlock(&mtx);
+}
+
+int db_auth_result(
+    char *username, int username_length,
+    char *identity_token, int identity_token_length)
+{
+    int result;
+    if (db_enabled) {
+        mtx_lock(&mtx);
+    }
+    result = auth_result;
+    if (result) {
+        snprintf(username, username_length, "%s", auth_username);
+        snprintf(identity_token, identity_token_length, "%s",
+            auth_identity_token);
+        auth_result = DB_AUTH_NONE;
+    }
+    if (db_enabled) {
+        mtx_unlock(&mtx);
+    }
+    return result;
+}
+
 void db_save_state(float x, float y, float z, float rx, float ry) {
     if (!db_enabled) {
         return;
     }
+    mtx_lock(&mtx);
+    state[0] = x;
+    state[1] = y;
+    state[2] = z;
+    state[3] = rx;
+    state[4] = ry;
+    mtx_unlock(&mtx);
+    RingEntry e = {STATE};
+    spsc_put(&ring, &e);
+}
+
+static void _db_save_state() {
     static const char *query =
         "insert into state (x, y, z, rx, ry) values (?, ?, ?, ?, ?);";
+    float values[5];
+    mtx_lock(&mtx);
+    memcpy(values, state, sizeof(values));
+    mtx_unlock(&mtx);
     sqlite3_stmt *stmt;
     sqlite3_exec(db, "delete from state;", NULL, NULL, NULL);
     sqlite3_prepare_v2(db, query, -1, &stmt, NULL);
-    sqlite3_bind_double(stmt, 1, x);
-    sqlite3_bind_double(stmt, 2, y);
-    sqlite3_bind_double(stmt, 3, z);
-    sqlite3_bind_double(stmt, 4, rx);
-    sqlite3_bind_double(stmt, 5, ry);
+    for (int i = 0; i < 5; i++) {
+        sqlite3_bind_double(stmt, i + 1, values[i]);
+    }
     sqlite3_step(stmt);
     sqlite3_finalize(stmt);
 }
@@ -316,42 +1274,59 @@ void db_insert_block(int p, int q, int x, int y, int z, int w) {
     if (!db_enabled) {
         return;
     }
-    mtx_lock(&mtx);
-    ring_put_block(&ring, p, q, x, y, z, w);
-    cnd_signal(&cnd);
-    mtx_unlock(&mtx);
+    RingEntry e = {BLOCK, p, q, x, y, z, w};
+    spsc_put(&ring, &e);
 }
 
 void _db_insert_block(int p, int q, int x, int y, int z, int w) {
-    sqlite3_reset(insert_block_stmt);
-    sqlite3_bind_int(insert_block_stmt, 1, p);
-    sqlite3_bind_int(insert_block_stmt, 2, q);
-    sqlite3_bind_int(insert_block_stmt, 3, x);
-    sqlite3_bind_int(insert_block_stmt, 4, y);
-    sqlite3_bind_int(insert_block_stmt, 5, z);
-    sqlite3_bind_int(insert_block_stmt, 6, w);
-    sqlite3_step(insert_block_stmt);
+    RingEntry e = {BLOCK, p, q, x, y, z, w, 0};
+    pending_put(&e);
 }
 
 void db_insert_light(int p, int q, int x, int y, int z, int w) {
     if (!db_enabled) {
         return;
     }
-    mtx_lock(&mtx);
-    ring_put_light(&ring, p, q, x, y, z, w);
-    cnd_signal(&cnd);
-    mtx_unlock(&mtx);
+    RingEntry e = {LIGHT, p, q, x, y, z, w};
+    spsc_put(&ring, &e);
 }
 
 void _db_insert_light(int p, int q, int x, int y, int z, int w) {
-    sqlite3_reset(insert_light_stmt);
-    sqlite3_bind_int(insert_light_stmt, 1, p);
-    sqlite3_bind_int(insert_light_stmt, 2, q);
-    sqlite3_bind_int(insert_light_stmt, 3, x);
-    sqlite3_bind_int(insert_light_stmt, 4, y);
-    sqlite3_bind_int(insert_light_stmt, 5, z);
-    sqlite3_bind_int(insert_light_stmt, 6, w);
-    sqlite3_step(insert_light_stmt);
+    RingEntry e = {LIGHT, p, q, x, y, z, w, 0};
+    pending_put(&e);
+}
+
+void db_insert_blocks(int p, int q, int *blocks, int count) {
+    // blocks holds x, y, z, w for each of count blocks
+    if (!db_enabled || !count) {
+        return;
+    }
+    RingEntry e = {BLOCKS, p, q, 0, 0, 0, count};
+    e.data = (char *)malloc(sizeof(int) * 4 * count);
+    memcpy(e.data, blocks, sizeof(int) * 4 * count);
+    spsc_put(&ring, &e);
+}
+
+void db_insert_lights(int p, int q, int *lights, int count) {
+    if (!db_enabled || !count) {
+        return;
+    }
+    RingEntry e = {LIGHTS, p, q, 0, 0, 0, count};
+    e.data = (char *)malloc(sizeof(int) * 4 * count);
+    memcpy(e.data, lights, sizeof(int) * 4 * count);
+    spsc_put(&ring, &e);
+}
+
+static void _db_insert_batch(RingEntryType type, int p, int q,
+    int *data, int count)
+{
+    mtx_lock(&pending_mtx);
+    PendingChunk *chunk = pending_chunk(&pending, type, p, q);
+    for (int i = 0; i < count; i++) {
+        int *a = data + i * 4;
+        pending_set(chunk, a[0], a[1], a[2], a[3]);
+    }
+    mtx_unlock(&pending_mtx);
 }
 
 void db_insert_sign(
@@ -360,6 +1335,15 @@ void db_insert_sign(
     if (!db_enabled) {
         return;
     }
+    RingEntry e = {SIGN, p, q, x, y, z, face};
+    e.data = copy_text(text, 0);
+    spsc_put(&ring, &e);
+    sign_changes = 1;
+}
+
+static void _db_insert_sign(
+    int p, int q, int x, int y, int z, int face, const char *text)
+{
     sqlite3_reset(insert_sign_stmt);
     sqlite3_bind_int(insert_sign_stmt, 1, p);
     sqlite3_bind_int(insert_sign_stmt, 2, q);
@@ -375,6 +1359,12 @@ void db_delete_sign(int x, int y, int z, int face) {
     if (!db_enabled) {
         return;
     }
+    RingEntry e = {DELETE_SIGN, 0, 0, x, y, z, face};
+    spsc_put(&ring, &e);
+    sign_changes = 1;
+}
+
+static void _db_delete_sign(int x, int y, int z, int face) {
     sqlite3_reset(delete_sign_stmt);
     sqlite3_bind_int(delete_sign_stmt, 1, x);
     sqlite3_bind_int(delete_sign_stmt, 2, y);
@@ -387,6 +1377,12 @@ void db_delete_signs(int x, int y, int z) {
     if (!db_enabled) {
         return;
     }
+    RingEntry e = {DELETE_SIGNS, 0, 0, x, y, z};
+    spsc_put(&ring, &e);
+    sign_changes = 1;
+}
+
+static void _db_delete_signs(int x, int y, int z) {
     sqlite3_reset(delete_signs_stmt);
     sqlite3_bind_int(delete_signs_stmt, 1, x);
     sqlite3_bind_int(delete_signs_stmt, 2, y);
@@ -394,105 +1390,248 @@ void db_delete_signs(int x, int y, int z) {
     sqlite3_step(delete_signs_stmt);
 }
 
+void db_delete_chunk_signs(int p, int q) {
+    if (!db_enabled) {
+        return;
+    }
+    RingEntry e = {DELETE_CHUNK_SIGNS, p, q};
+    spsc_put(&ring, &e);
+    sign_changes = 1;
+}
+
+static void _db_delete_chunk_signs(int p, int q) {
+    sqlite3_reset(delete_chunk_signs_stmt);
+    sqlite3_bind_int(delete_chunk_signs_stmt, 1, p);
+    sqlite3_bind_int(delete_chunk_signs_stmt, 2, q);
+    sqlite3_step(delete_chunk_signs_stmt);
+}
+
 void db_delete_all_signs() {
     if (!db_enabled) {
         return;
     }
-    sqlite3_exec(db, "delete from sign;", NULL, NULL, NULL);
+    RingEntry e = {DELETE_ALL_SIGNS};
+    spsc_put(&ring, &e);
+    sign_changes = 1;
+}
+
+static void db_load_map(Map *map, RingEntryType type, int p, int q) {
+    int layer = type == BLOCK ? STORAGE_BLOCKS : STORAGE_LIGHTS;
+    while (1) {
+        int commits = ATOMIC_LOAD(&commit_count);
+        storage->load(layer, p, q, map);
+        // the pending table holds everything not yet committed, unless a
+        // commit slipped in after our snapshot was taken
+        mtx_lock(&pending_mtx);
+        if (commits == commit_count) {
+            pending_load(map, type, p, q);
+            mtx_unlock(&pending_mtx);
+            break;
+        }
+        mtx_unlock(&pending_mtx);
+    }
 }
 
 void db_load_blocks(Map *map, int p, int q) {
     if (!db_enabled) {
         return;
     }
-    mtx_lock(&load_mtx);
-    sqlite3_reset(load_blocks_stmt);
-    sqlite3_bind_int(load_blocks_stmt, 1, p);
-    sqlite3_bind_int(load_blocks_stmt, 2, q);
-    while (sqlite3_step(load_blocks_stmt) == SQLITE_ROW) {
-        int x = sqlite3_column_int(load_blocks_stmt, 0);
-        int y = sqlite3_column_int(load_blocks_stmt, 1);
-        int z = sqlite3_column_int(load_blocks_stmt, 2);
-        int w = sqlite3_column_int(load_blocks_stmt, 3);
-        map_set(map, x, y, z, w);
-    }
-    mtx_unlock(&load_mtx);
+    db_load_map(map, BLOCK, p, q);
 }
 
 void db_load_lights(Map *map, int p, int q) {
     if (!db_enabled) {
         return;
     }
-    mtx_lock(&load_mtx);
-    sqlite3_reset(load_lights_stmt);
-    sqlite3_bind_int(load_lights_stmt, 1, p);
-    sqlite3_bind_int(load_lights_stmt, 2, q);
-    while (sqlite3_step(load_lights_stmt) == SQLITE_ROW) {
-        int x = sqlite3_column_int(load_lights_stmt, 0);
-        int y = sqlite3_column_int(load_lights_stmt, 1);
-        int z = sqlite3_column_int(load_lights_stmt, 2);
-        int w = sqlite3_column_int(load_lights_stmt, 3);
-        map_set(map, x, y, z, w);
-    }
-    mtx_unlock(&load_mtx);
+    db_load_map(map, LIGHT, p, q);
 }
 
 void db_load_signs(SignList *list, int p, int q) {
     if (!db_enabled) {
         return;
     }
-    sqlite3_reset(load_signs_stmt);
-    sqlite3_bind_int(load_signs_stmt, 1, p);
-    sqlite3_bind_int(load_signs_stmt, 2, q);
-    while (sqlite3_step(load_signs_stmt) == SQLITE_ROW) {
-        int x = sqlite3_column_int(load_signs_stmt, 0);
-        int y = sqlite3_column_int(load_signs_stmt, 1);
-        int z = sqlite3_column_int(load_signs_stmt, 2);
-        int face = sqlite3_column_int(load_signs_stmt, 3);
-        const char *text = (const char *)sqlite3_column_text(
-            load_signs_stmt, 4);
+    Reader *reader = reader_claim();
+    sqlite3_stmt *stmt = reader->load_signs_stmt;
+    sqlite3_reset(stmt);
+    sqlite3_bind_int(stmt, 1, p);
+    sqlite3_bind_int(stmt, 2, q);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        int x = sqlite3_column_int(stmt, 0);
+        int y = sqlite3_column_int(stmt, 1);
+        int z = sqlite3_column_int(stmt, 2);
+        int face = sqlite3_column_int(stmt, 3);
+        const char *text = (const char *)sqlite3_column_text(stmt, 4);
         sign_list_add(list, x, y, z, face, text);
     }
+    sqlite3_reset(stmt);
+    reader_release(reader);
 }
 
-int db_get_key(int p, int q) {
+void db_load_range(
+    int p0, int q0, int p1, int q1,
+    Map **block_maps, Map **light_maps, SignList **sign_lists)
+{
+    // the maps and lists are indexed by (p - p0) * (q1 - q0 + 1) + q - q0,
+    // null entries are skipped
     if (!db_enabled) {
-        return 0;
+        return;
     }
-    sqlite3_reset(get_key_stmt);
-    sqlite3_bind_int(get_key_stmt, 1, p);
-    sqlite3_bind_int(get_key_stmt, 2, q);
-    if (sqlite3_step(get_key_stmt) == SQLITE_ROW) {
-        return sqlite3_column_int(get_key_stmt, 0);
+    int n = q1 - q0 + 1;
+    while (1) {
+        int commits = ATOMIC_LOAD(&commit_count);
+        if (storage->load_range) {
+            storage->load_range(
+                STORAGE_BLOCKS, p0, q0, p1, q1, block_maps);
+            storage->load_range(
+                STORAGE_LIGHTS, p0, q0, p1, q1, light_maps);
+        }
+        else {
+            for (int i = 0; i < (p1 - p0 + 1) * n; i++) {
+                int p = p0 + i / n;
+                int q = q0 + i % n;
+                if (block_maps[i]) {
+                    storage->load(STORAGE_BLOCKS, p, q, block_maps[i]);
+                }
+                if (light_maps[i]) {
+                    storage->load(STORAGE_LIGHTS, p, q, light_maps[i]);
+                }
+            }
+        }
+        mtx_lock(&pending_mtx);
+        if (commits == commit_count) {
+            for (int i = 0; i < (p1 - p0 + 1) * n; i++) {
+                int p = p0 + i / n;
+                int q = q0 + i % n;
+                if (block_maps[i]) {
+                    pending_load(block_maps[i], BLOCK, p, q);
+                }
+                if (light_maps[i]) {
+                    pending_load(light_maps[i], LIGHT, p, q);
+                }
+            }
+            mtx_unlock(&pending_mtx);
+            break;
+        }
+        mtx_unlock(&pending_mtx);
     }
-    return 0;
+    Reader *reader = reader_claim();
+    sqlite3_stmt *stmt = reader->range_signs_stmt;
+    db_range_query(stmt, p0, q0, p1, q1);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        int p = sqlite3_column_int(stmt, 0);
+        int q = sqlite3_column_int(stmt, 1);
+        SignList *list = sign_lists[(p - p0) * n + (q - q0)];
+        if (list) {
+            int x = sqlite3_column_int(stmt, 2);
+            int y = sqlite3_column_int(stmt, 3);
+            int z = sqlite3_column_int(stmt, 4);
+            int face = sqlite3_column_int(stmt, 5);
+            const char *text = (const char *)sqlite3_column_text(stmt, 6);
+            sign_list_add(list, x, y, z, face, text);
+        }
+    }
+    sqlite3_reset(stmt);
+    reader_release(reader);
 }
 
-void db_set_key(int p, int q, int key) {
+void db_load_keys(key_func func, void *arg) {
     if (!db_enabled) {
         return;
     }
-    mtx_lock(&mtx);
-    ring_put_key(&ring, p, q, key);
-    cnd_signal(&cnd);
-    mtx_unlock(&mtx);
+    Reader *reader = reader_claim();
+    sqlite3_stmt *stmt;
+    sqlite3_prepare_v2(reader->db, "select p, q, key, sign_key from key;",
+        -1, &stmt, NULL);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        int p = sqlite3_column_int(stmt, 0);
+        int q = sqlite3_column_int(stmt, 1);
+        int key = sqlite3_column_int(stmt, 2);
+        int sign_key = sqlite3_column_int(stmt, 3);
+        func(p, q, key, sign_key, arg);
+    }
+    sqlite3_finalize(stmt);
+    reader_release(reader);
+}
+
+void db_set_key(int p, int q, int key, int sign_key) {
+    if (!db_enabled) {
+        return;
+    }
+    RingEntry e = {KEY, p, q, 0, 0, 0, sign_key, key};
+    spsc_put(&ring, &e);
 }
 
-void _db_set_key(int p, int q, int key) {
+void _db_set_key(int p, int q, int key, int sign_key) {
     sqlite3_reset(set_key_stmt);
     sqlite3_bind_int(set_key_stmt, 1, p);
     sqlite3_bind_int(set_key_stmt, 2, q);
     sqlite3_bind_int(set_key_stmt, 3, key);
+    sqlite3_bind_int(set_key_stmt, 4, sign_key);
     sqlite3_step(set_key_stmt);
 }
 
+void db_set_cache_size(int size) {
+    // bounds the database to about size bytes by evicting the chunks that
+    // were requested longest ago, 0 keeps everything, must precede db_init
+    cache_size = size;
+}
+
+void db_access_chunk(int p, int q) {
+    if (!db_enabled || !cache_size) {
+        return;
+    }
+    RingEntry e = {ACCESS, p, q};
+    spsc_put(&ring, &e);
+}
+
+static void _db_access_chunk(int p, int q) {
+    sqlite3_reset(access_stmt);
+    sqlite3_bind_int(access_stmt, 1, p);
+    sqlite3_bind_int(access_stmt, 2, q);
+    sqlite3_bind_int(access_stmt, 3, time(NULL));
+    sqlite3_step(access_stmt);
+}
+
+void db_evictions(evict_func func, void *arg) {
+    // passes on the chunks proposed by the worker, func answers each with
+    // db_evict_chunk or, to keep it, db_access_chunk
+    if (!db_enabled) {
+        return;
+    }
+    int count = ATOMIC_LOAD(&eviction_count);
+    for (int i = 0; i < count; i++) {
+        func(evictions[i][0], evictions[i][1], arg);
+    }
+    if (count) {
+        ATOMIC_STORE(&eviction_count, 0);
+    }
+}
+
+void db_evict_chunk(int p, int q) {
+    if (!db_enabled) {
+        return;
+    }
+    RingEntry e = {EVICT, p, q};
+    spsc_put(&ring, &e);
+}
+
+static void _db_evict_chunk(int p, int q) {
+    storage->remove(p, q);
+    db_delete_chunk("sign", p, q);
+    db_delete_chunk("key", p, q);
+    db_delete_chunk("access", p, q);
+}
+
 void db_worker_start(char *path) {
     if (!db_enabled) {
         return;
     }
-    ring_alloc(&ring, 1024);
+    spsc_alloc(&ring, RING_SIZE);
+    waiting = 0;
     mtx_init(&mtx, mtx_plain);
-    mtx_init(&load_mtx, mtx_plain);
+    mtx_init(&pending_mtx, mtx_plain);
+    pending_alloc(&pending, 255);
+    pending_alloc(&flushing, 255);
     cnd_init(&cnd);
     thrd_create(&thrd, db_worker_run, path);
 }
@@ -501,43 +1640,442 @@ void db_worker_stop() {
     if (!db_enabled) {
         return;
     }
-    mtx_lock(&mtx);
-    ring_put_exit(&ring);
-    cnd_signal(&cnd);
-    mtx_unlock(&mtx);
+    RingEntry e = {EXIT};
+    spsc_put(&ring, &e);
+    while (db_flush()) {
+        thrd_yield();
+    }
     thrd_join(thrd, NULL);
     cnd_destroy(&cnd);
-    mtx_destroy(&load_mtx);
+    mtx_destroy(&pending_mtx);
     mtx_destroy(&mtx);
-    ring_free(&ring);
+    spsc_free(&ring);
+    pending_free(&pending);
+    pending_free(&flushing);
+}
+
+static double db_time() {
+    struct timespec ts;
+    clock_gettime(TIME_UTC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
 int db_worker_run(void *arg) {
     int running = 1;
     while (running) {
         RingEntry e;
-        mtx_lock(&mtx);
-        while (!ring_get(&ring, &e)) {
-            cnd_wait(&cnd, &mtx);
+        if (spsc_empty(&ring)) {
+            mtx_lock(&mtx);
+            ATOMIC_STORE(&waiting, 1);
+            ATOMIC_FENCE();
+            if (spsc_empty(&ring)) {
+                cnd_wait(&cnd, &mtx);
+            }
+            ATOMIC_STORE(&waiting, 0);
+            mtx_unlock(&mtx);
+            continue;
         }
-        mtx_unlock(&mtx);
-        switch (e.type) {
-            case BLOCK:
-                _db_insert_block(e.p, e.q, e.x, e.y, e.z, e.w);
-                break;
-            case LIGHT:
-                _db_insert_light(e.p, e.q, e.x, e.y, e.z, e.w);
-                break;
-            case KEY:
-                _db_set_key(e.p, e.q, e.key);
-                break;
-            case COMMIT:
-                _db_commit();
-                break;
-            case EXIT:
-                running = 0;
-                break;
+        double start = db_time();
+        // block and light writes collect in the pending table until the
+        // next commit, loads see them through pending_load
+        while (running && spsc_get(&ring, &e)) {
+            switch (e.type) {
+                case BLOCK:
+                    _db_insert_block(e.p, e.q, e.x, e.y, e.z, e.w);
+                    break;
+                case LIGHT:
+                    _db_insert_light(e.p, e.q, e.x, e.y, e.z, e.w);
+                    break;
+                case KEY:
+                    _db_set_key(e.p, e.q, e.key, e.w);
+                    break;
+                case COMMIT:
+                    _db_commit();
+                    break;
+                case EXIT:
+                    pending_flush();
+                    pending_committed();
+                    running = 0;
+                    break;
+                case SIGN:
+                    _db_insert_sign(e.p, e.q, e.x, e.y, e.z, e.w, e.data);
+                    break;
+                case DELETE_SIGN:
+                    _db_delete_sign(e.x, e.y, e.z, e.w);
+                    break;
+                case DELETE_SIGNS:
+                    _db_delete_signs(e.x, e.y, e.z);
+                    break;
+                case ACCESS:
+                    _db_access_chunk(e.p, e.q);
+                    break;
+                case EVICT:
+                    _db_evict_chunk(e.p, e.q);
+                    break;
+                case DELETE_CHUNK_SIGNS:
+                    _db_delete_chunk_signs(e.p, e.q);
+                    break;
+                case DELETE_ALL_SIGNS:
+                    sqlite3_exec(db, "delete from sign;", NULL, NULL, NULL);
+                    break;
+                case STATE:
+                    _db_save_state();
+                    break;
+                case AUTH_SET:
+                    _db_auth_set(e.data, e.data + strlen(e.data) + 1);
+                    break;
+                case AUTH_SELECT:
+                    _db_auth_select(e.data);
+                    break;
+                case AUTH_SELECT_NONE:
+                    _db_auth_select_none();
+                    break;
+                case AUTH_LOGIN:
+                    _db_auth_login();
+                    break;
+                case BLOCKS:
+                    _db_insert_batch(BLOCK, e.p, e.q, (int *)e.data, e.w);
+                    break;
+                case LIGHTS:
+                    _db_insert_batch(LIGHT, e.p, e.q, (int *)e.data, e.w);
+                    break;
+            }
+            free(e.data);
         }
+        double elapsed = db_time() - start;
+        mtx_lock(&mtx);
+        write_count += rows_written;
+        write_saved += rows_saved;
+        write_time += elapsed;
+        mtx_unlock(&mtx);
+        rows_written = 0;
+        rows_saved = 0;
     }
     return 0;
 }
+
+#define BENCH_NAME "craft-bench.db"
+#define BENCH_EDITS 1000
+
+typedef struct {
+    int p0;
+    int q0;
+    int n;
+    int count;
+    Voxel **chunks;
+    int *sizes;
+    int edit_count;
+    int *edit_chunks;
+    Voxel *edits;
+} BenchData;
+
+static char bench_path[512];
+static char bench_regions_path[520];
+
+static void bench_paths() {
+    // the scratch databases go to the temporary directory
+    const char *dir = getenv("TMPDIR");
+    if (!dir) {
+        dir = getenv("TEMP");
+    }
+    if (!dir) {
+#ifdef _WIN32
+        dir = ".";
+#else
+        dir = "/tmp";
+#endif
+    }
+    snprintf(bench_path, sizeof(bench_path), "%s/%s", dir, BENCH_NAME);
+    snprintf(bench_regions_path, sizeof(bench_regions_path), "%s.regions",
+        bench_path);
+}
+
+static int bench_size(sqlite3 *conn) {
+    sqlite3_stmt *stmt;
+    int pages = 0;
+    int page_size = 0;
+    sqlite3_prepare_v2(conn, "pragma page_count;", -1, &stmt, NULL);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        pages = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_prepare_v2(conn, "pragma page_size;", -1, &stmt, NULL);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        page_size = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    return pages * page_size;
+}
+
+static sqlite3 *bench_open(int blobs) {
+    sqlite3 *conn;
+    sqlite3_open(bench_path, &conn);
+    sqlite3_exec(conn,
+        "pragma journal_mode = wal; pragma synchronous = normal;",
+        NULL, NULL, NULL);
+    if (blobs) {
+        sqlite3_exec(conn,
+            "create table if not exists block_blob (p int not null,"
+            "    q int not null, data blob not null);"
+            "create unique index if not exists block_blob_pq_idx"
+            "    on block_blob (p, q);",
+            NULL, NULL, NULL);
+    }
+    else {
+        sqlite3_exec(conn,
+            "create table if not exists block (p int not null,"
+            "    q int not null, x int not null, y int not null,"
+            "    z int not null, w int not null);"
+            "create unique index if not exists block_pqxyz_idx"
+            "    on block (p, q, x, y, z);",
+            NULL, NULL, NULL);
+    }
+    return conn;
+}
+
+static void bench_remove() {
+    char path[520];
+    remove(bench_path);
+    snprintf(path, sizeof(path), "%s-wal", bench_path);
+    remove(path);
+    snprintf(path, sizeof(path), "%s-shm", bench_path);
+    remove(path);
+    region_store_remove(bench_regions_path);
+}
+
+static void bench_insert(
+    sqlite3_stmt *stmt, int blobs, int p, int q, Voxel *voxels, int count)
+{
+    if (blobs) {
+        int size;
+        unsigned char *data = blob_encode(voxels, count, &size);
+        sqlite3_reset(stmt);
+        sqlite3_bind_int(stmt, 1, p);
+        sqlite3_bind_int(stmt, 2, q);
+        sqlite3_bind_blob(stmt, 3, data, size, SQLITE_TRANSIENT);
+        sqlite3_step(stmt);
+        free(data);
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        int x, y, z;
+        blob_position(p, q, voxels[i].key, &x, &y, &z);
+        sqlite3_reset(stmt);
+        sqlite3_bind_int(stmt, 1, p);
+        sqlite3_bind_int(stmt, 2, q);
+        sqlite3_bind_int(stmt, 3, x);
+        sqlite3_bind_int(stmt, 4, y);
+        sqlite3_bind_int(stmt, 5, z);
+        sqlite3_bind_int(stmt, 6, voxels[i].w);
+        sqlite3_step(stmt);
+    }
+}
+
+static void bench_sqlite(BenchData *data, int blobs, DbBenchmarkResult *result) {
+    const char *insert_query = blobs ?
+        "insert or replace into block_blob (p, q, data) values (?, ?, ?);" :
+        "insert or replace into block (p, q, x, y, z, w) "
+        "values (?, ?, ?, ?, ?, ?);";
+    const char *select_query = blobs ?
+        "select data from block_blob where p = ? and q = ?;" :
+        "select x, y, z, w from block where p = ? and q = ?;";
+    sqlite3_stmt *insert;
+    sqlite3_stmt *select;
+    bench_remove();
+    // writes
+    double start = db_time();
+    sqlite3 *conn = bench_open(blobs);
+    sqlite3_prepare_v2(conn, insert_query, -1, &insert, NULL);
+    sqlite3_exec(conn, "begin;", NULL, NULL, NULL);
+    for (int i = 0; i < data->count; i++) {
+        int p = data->p0 + i / data->n;
+        int q = data->q0 + i % data->n;
+        bench_insert(insert, blobs, p, q, data->chunks[i], data->sizes[i]);
+    }
+    sqlite3_exec(conn, "commit;", NULL, NULL, NULL);
+    sqlite3_finalize(insert);
+    result->write = db_time() - start;
+    sqlite3_exec(conn, "pragma wal_checkpoint(truncate);", NULL, NULL, NULL);
+    result->size = bench_size(conn);
+    sqlite3_close(conn);
+    // cold loads, from a fresh connection
+    start = db_time();
+    conn = bench_open(blobs);
+    sqlite3_prepare_v2(conn, select_query, -1, &select, NULL);
+    for (int i = 0; i < data->count; i++) {
+        int p = data->p0 + i / data->n;
+        int q = data->q0 + i % data->n;
+        Map map;
+        map_alloc(&map, p * CHUNK_SIZE - 1, 0, q * CHUNK_SIZE - 1, 0x7fff);
+        sqlite3_reset(select);
+        sqlite3_bind_int(select, 1, p);
+        sqlite3_bind_int(select, 2, q);
+        while (sqlite3_step(select) == SQLITE_ROW) {
+            if (blobs) {
+                map_set_blob(&map, p, q, select, 0);
+            }
+            else {
+                map_set_row(&map, select, 0);
+            }
+        }
+        map_free(&map);
+    }
+    result->load = db_time() - start;
+    // random edits, a blob is rewritten for every edit
+    start = db_time();
+    sqlite3_prepare_v2(conn, insert_query, -1, &insert, NULL);
+    sqlite3_exec(conn, "begin;", NULL, NULL, NULL);
+    for (int i = 0; i < data->edit_count; i++) {
+        int p = data->p0 + data->edit_chunks[i] / data->n;
+        int q = data->q0 + data->edit_chunks[i] % data->n;
+        Voxel *edit = data->edits + i;
+        if (!blobs) {
+            bench_insert(insert, 0, p, q, edit, 1);
+            continue;
+        }
+        Voxel *stored = 0;
+        int stored_count = 0;
+        sqlite3_reset(select);
+        sqlite3_bind_int(select, 1, p);
+        sqlite3_bind_int(select, 2, q);
+        if (sqlite3_step(select) == SQLITE_ROW) {
+            stored = blob_decode(sqlite3_column_blob(select, 0),
+                sqlite3_column_bytes(select, 0), &stored_count);
+        }
+        sqlite3_reset(select);
+        int merged_count;
+        Voxel *merged = blob_merge(
+            stored, stored_count, edit, 1, &merged_count);
+        bench_insert(insert, 1, p, q, merged, merged_count);
+        free(stored);
+        free(merged);
+    }
+    sqlite3_exec(conn, "commit;", NULL, NULL, NULL);
+    result->edit = db_time() - start;
+    sqlite3_finalize(insert);
+    sqlite3_finalize(select);
+    sqlite3_close(conn);
+}
+
+static void bench_regions(BenchData *data, DbBenchmarkResult *result) {
+    RegionStore store;
+    bench_remove();
+    // writes
+    double start = db_time();
+    if (region_store_open(&store, bench_regions_path)) {
+        return;
+    }
+    for (int i = 0; i < data->count; i++) {
+        int p = data->p0 + i / data->n;
+        int q = data->q0 + i % data->n;
+        if (data->sizes[i]) {
+            region_store_save(&store, STORAGE_BLOCKS, p, q,
+                data->chunks[i], data->sizes[i]);
+        }
+    }
+    region_store_commit(&store);
+    result->write = db_time() - start;
+    result->size = region_store_size(&store, 0);
+    region_store_close(&store);
+    // cold loads, from freshly mapped files
+    start = db_time();
+    region_store_open(&store, bench_regions_path);
+    for (int i = 0; i < data->count; i++) {
+        int p = data->p0 + i / data->n;
+        int q = data->q0 + i % data->n;
+        Map map;
+        map_alloc(&map, p * CHUNK_SIZE - 1, 0, q * CHUNK_SIZE - 1, 0x7fff);
+        int count;
+        Voxel *voxels = region_store_load(
+            &store, STORAGE_BLOCKS, p, q, &count);
+        map_set_voxels(&map, p, q, voxels, count);
+        free(voxels);
+        map_free(&map);
+    }
+    result->load = db_time() - start;
+    // random edits
+    start = db_time();
+    for (int i = 0; i < data->edit_count; i++) {
+        int p = data->p0 + data->edit_chunks[i] / data->n;
+        int q = data->q0 + data->edit_chunks[i] % data->n;
+        region_store_save(
+            &store, STORAGE_BLOCKS, p, q, data->edits + i, 1);
+    }
+    region_store_commit(&store);
+    result->edit = db_time() - start;
+    region_store_close(&store);
+}
+
+void db_benchmark(int p0, int q0, int p1, int q1, DbBenchmark *result) {
+    // copies the saved blocks of a range of chunks to a scratch store of
+    // every backend, reads them back chunk by chunk after reopening it and
+    // then applies the same random edits to each
+    memset(result, 0, sizeof(DbBenchmark));
+    for (int i = 0; i < DB_BENCHMARK_STORAGES; i++) {
+        result->results[i].name = storages[i].name;
+    }
+    if (!db_enabled) {
+        return;
+    }
+    bench_paths();
+    BenchData data;
+    data.p0 = p0;
+    data.q0 = q0;
+    data.n = q1 - q0 + 1;
+    data.count = (p1 - p0 + 1) * data.n;
+    data.chunks = (Voxel **)calloc(data.count, sizeof(Voxel *));
+    data.sizes = (int *)calloc(data.count, sizeof(int));
+    for (int i = 0; i < data.count; i++) {
+        int p = p0 + i / data.n;
+        int q = q0 + i % data.n;
+        Map block_map;
+        Map *map = &block_map;
+        map_alloc(map, p * CHUNK_SIZE - 1, 0, q * CHUNK_SIZE - 1, 0xff);
+        db_load_map(map, BLOCK, p, q);
+        Voxel *voxels = (Voxel *)malloc(sizeof(Voxel) * (map->size + 1));
+        int n = 0;
+        MAP_FOR_EACH(map, ex, ey, ez, ew) {
+            voxels[n].key = blob_key(p, q, ex, ey, ez);
+            voxels[n++].w = ew;
+        } END_MAP_FOR_EACH;
+        blob_sort(voxels, n);
+        data.chunks[i] = voxels;
+        data.sizes[i] = n;
+        map_free(map);
+        result->chunks += n ? 1 : 0;
+        result->voxels += n;
+    }
+    // a fixed seed so that runs are comparable
+    unsigned int seed = 1;
+    data.edit_count = BENCH_EDITS;
+    data.edit_chunks = (int *)malloc(sizeof(int) * BENCH_EDITS);
+    data.edits = (Voxel *)malloc(sizeof(Voxel) * BENCH_EDITS);
+    for (int i = 0; i < BENCH_EDITS; i++) {
+        int values[5];
+        for (int j = 0; j < 5; j++) {
+            seed = seed * 1103515245 + 12345;
+            values[j] = (seed >> 8) & 0xffff;
+        }
+        int index = values[0] % data.count;
+        int p = p0 + index / data.n;
+        int q = q0 + index % data.n;
+        int x = p * CHUNK_SIZE + values[1] % CHUNK_SIZE;
+        int y = 1 + values[2] % 255;
+        int z = q * CHUNK_SIZE + values[3] % CHUNK_SIZE;
+        data.edit_chunks[i] = index;
+        data.edits[i].key = blob_key(p, q, x, y, z);
+        data.edits[i].w = 1 + values[4] % 64;
+    }
+    result->edits = BENCH_EDITS;
+    bench_sqlite(&data, 0, result->results);
+    bench_sqlite(&data, 1, result->results + 1);
+    bench_regions(&data, result->results + 2);
+    bench_remove();
+    for (int i = 0; i < data.count; i++) {
+        free(data.chunks[i]);
+    }
+    free(data.chunks);
+    free(data.sizes);
+    free(data.edit_chunks);
+    free(data.edits);
+}
@@ -4,35 +4,75 @@
 #include "map.h"
 #include "sign.h"
 
+#define DB_AUTH_NONE 0
+#define DB_AUTH_ANONYMOUS 1
+#define DB_AUTH_SELECTED 2
+#define DB_AUTH_UNKNOWN 3
+
+#define DB_BENCHMARK_STORAGES 3
+
+typedef struct {
+    const char *name;
+    double write;
+    double load;
+    double edit;
+    int size;
+} DbBenchmarkResult;
+
+typedef struct {
+    int chunks;
+    int voxels;
+    int edits;
+    DbBenchmarkResult results[DB_BENCHMARK_STORAGES];
+} DbBenchmark;
+
+typedef void (*key_func)(int p, int q, int key, int sign_key, void *arg);
+typedef void (*evict_func)(int p, int q, void *arg);
+
 void db_enable();
 void db_disable();
 int get_db_enabled();
+int db_set_storage(const char *name);
+void db_set_cache_size(int size);
 int db_init(char *path);
 void db_close();
 void db_commit();
+int db_flush();
+void db_write_stats(int *count, int *saved, double *seconds);
 void db_auth_set(char *username, char *identity_token);
-int db_auth_select(char *username);
+void db_auth_select(char *username);
 void db_auth_select_none();
+void db_auth_login();
+int db_auth_result(
+    char *username, int username_length,
+    char *identity_token, int identity_token_length);
 int db_auth_get(
     char *username,
     char *identity_token, int identity_token_length);
-int db_auth_get_selected(
-    char *username, int username_length,
-    char *identity_token, int identity_token_length);
 void db_save_state(float x, float y, float z, float rx, float ry);
 int db_load_state(float *x, float *y, float *z, float *rx, float *ry);
 void db_insert_block(int p, int q, int x, int y, int z, int w);
 void db_insert_light(int p, int q, int x, int y, int z, int w);
+void db_insert_blocks(int p, int q, int *blocks, int count);
+void db_insert_lights(int p, int q, int *lights, int count);
 void db_insert_sign(
     int p, int q, int x, int y, int z, int face, const char *text);
 void db_delete_sign(int x, int y, int z, int face);
 void db_delete_signs(int x, int y, int z);
+void db_delete_chunk_signs(int p, int q);
 void db_delete_all_signs();
 void db_load_blocks(Map *map, int p, int q);
 void db_load_lights(Map *map, int p, int q);
 void db_load_signs(SignList *list, int p, int q);
-int db_get_key(int p, int q);
-void db_set_key(int p, int q, int key);
+void db_load_range(
+    int p0, int q0, int p1, int q1,
+    Map **block_maps, Map **light_maps, SignList **sign_lists);
+void db_load_keys(key_func func, void *arg);
+void db_benchmark(int p0, int q0, int p1, int q1, DbBenchmark *result);
+void db_set_key(int p, int q, int key, int sign_key);
+void db_access_chunk(int p, int q);
+void db_evictions(evict_func func, void *arg);
+void db_evict_chunk(int p, int q);
 void db_worker_start();
 void db_worker_stop();
 int db_worker_run(void *arg);
@@ -0,0 +1,79 @@
+#include <stdlib.h>
+#include <string.h>
+#include "keys.h"
+#include "map.h"
+
+void key_map_alloc(KeyMap *map, int mask) {
+    map->mask = mask;
+    map->size = 0;
+    map->data = (KeyEntry *)calloc(map->mask + 1, sizeof(KeyEntry));
+}
+
+void key_map_free(KeyMap *map) {
+    free(map->data);
+}
+
+void key_map_clear(KeyMap *map) {
+    map->size = 0;
+    memset(map->data, 0, sizeof(KeyEntry) * (map->mask + 1));
+}
+
+static void key_map_grow(KeyMap *map) {
+    KeyMap new_map;
+    key_map_alloc(&new_map, (map->mask << 1) | 1);
+    for (unsigned int i = 0; i <= map->mask; i++) {
+        KeyEntry *entry = map->data + i;
+        if (entry->used) {
+            key_map_set(&new_map, entry->p, entry->q, entry->key,
+                entry->sign_key, entry->dirty);
+        }
+    }
+    free(map->data);
+    map->mask = new_map.mask;
+    map->size = new_map.size;
+    map->data = new_map.data;
+}
+
+void key_map_set(
+    KeyMap *map, int p, int q, int key, int sign_key, int dirty)
+{
+    unsigned int index = hash(p, q, 0) & map->mask;
+    KeyEntry *entry = map->data + index;
+    while (entry->used) {
+        if (entry->p == p && entry->q == q) {
+            if (entry->key != key || entry->sign_key != sign_key) {
+                entry->key = key;
+                entry->sign_key = sign_key;
+                entry->dirty |= dirty;
+            }
+            return;
+        }
+        index = (index + 1) & map->mask;
+        entry = map->data + index;
+    }
+    entry->used = 1;
+    entry->p = p;
+    entry->q = q;
+    entry->key = key;
+    entry->sign_key = sign_key;
+    entry->dirty = dirty;
+    map->size++;
+    if (map->size * 2 > map->mask) {
+        key_map_grow(map);
+    }
+}
+
+int key_map_get(KeyMap *map, int p, int q, int *sign_key) {
+    unsigned int index = hash(p, q, 0) & map->mask;
+    KeyEntry *entry = map->data + index;
+    while (entry->used) {
+        if (entry->p == p && entry->q == q) {
+            *sign_key = entry->sign_key;
+            return entry->key;
+        }
+        index = (index + 1) & map->mask;
+        entry = map->data + index;
+    }
+    *sign_key = 0;
+    return 0;
+}
@@ -0,0 +1,26 @@
+#ifndef _keys_h_
+#define _keys_h_
+
+typedef struct {
+    int p;
+    int q;
+    int key;
+    int sign_key;
+    char used;
+    char dirty;
+} KeyEntry;
+
+typedef struct {
+    unsigned int mask;
+    unsigned int size;
+    KeyEntry *data;
+} KeyMap;
+
+void key_map_alloc(KeyMap *map, int mask);
+void key_map_free(KeyMap *map);
+void key_map_clear(KeyMap *map);
+void key_map_set(
+    KeyMap *map, int p, int q, int key, int sign_key, int dirty);
+int key_map_get(KeyMap *map, int p, int q, int *sign_key);
+
+#endif
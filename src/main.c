@@ -6,15 +6,21 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include "atomic.h"
 #include "auth.h"
 #include "client.h"
+#include "cold.h"
 #include "config.h"
 #include "cube.h"
 #include "db.h"
 #include "item.h"
+#include "keys.h"
 #include "map.h"
+#include "message.h"
 #include "matrix.h"
 #include "noise.h"
+#include "queue.h"
+#include "ring.h"
 #include "sign.h"
 #include "tinycthread.h"
 #include "util.h"
@@ -22,7 +28,18 @@
 
 #define MAX_CHUNKS 8192
 #define MAX_PLAYERS 128
-#define WORKERS 4
+#define GENERATE_WORKERS 1
+#define LOAD_WORKERS 1
+#define LIGHT_WORKERS 1
+#define MESH_WORKERS 3
+#define STORE_WORKERS 1
+#define WORKERS (GENERATE_WORKERS + LOAD_WORKERS + LIGHT_WORKERS + \
+    MESH_WORKERS + STORE_WORKERS)
+#define MAX_LOAD_JOBS ((GENERATE_WORKERS + LOAD_WORKERS) * 4)
+#define MAX_MESH_JOBS ((LIGHT_WORKERS + MESH_WORKERS) * 2)
+#define MAX_STORE_JOBS (STORE_WORKERS * 16)
+#define MESH_SLABS MESH_WORKERS
+#define FRAME_SAMPLES 1024
 #define MAX_TEXT_LENGTH 256
 #define MAX_NAME_LENGTH 32
 #define MAX_PATH_LENGTH 256
@@ -35,9 +52,12 @@
 #define MODE_OFFLINE 0
 #define MODE_ONLINE 1
 
-#define WORKER_IDLE 0
-#define WORKER_BUSY 1
-#define WORKER_DONE 2
+#define STAGE_GENERATE 0
+#define STAGE_LOAD 1
+#define STAGE_LIGHT 2
+#define STAGE_MESH 3
+#define STAGE_STORE 4
+#define STAGES 5
 
 typedef struct {
     Map map;
@@ -50,29 +70,54 @@ typedef struct {
     int dirty;
     int miny;
     int maxy;
+    int id;
+    int loaded;
+    int busy;
+    int forced;
+    int edited;
     GLuint buffer;
     GLuint sign_buffer;
+    GLfloat *mesh;
 } Chunk;
 
-typedef struct {
+typedef struct WorkerItem {
+    QueueNode node;
+    struct WorkerItem *next;
+    int stage;
+    int priority;
+    int id;
     int p;
     int q;
-    int load;
     Map *block_maps[3][3];
     Map *light_maps[3][3];
+    char *opaque;
+    char *light;
+    char *highest;
+    SignList signs;
+    struct WorkerItem *band;
+    struct WorkerItem *parent;
+    struct WorkerItem *slabs;
+    int slab_count;
+    int pending;
+    int y0;
+    int y1;
     int miny;
     int maxy;
     int faces;
     GLfloat *data;
+    ColdEntry *cold;
 } WorkerItem;
 
 typedef struct {
-    int index;
-    int state;
-    thrd_t thrd;
     mtx_t mtx;
     cnd_t cnd;
-    WorkerItem item;
+    WorkerItem *head;
+} Stage;
+
+typedef struct {
+    int index;
+    int stage;
+    thrd_t thrd;
 } Worker;
 
 typedef struct {
@@ -82,6 +127,16 @@ typedef struct {
     int w;
 } Block;
 
+typedef struct {
+    int p;
+    int q;
+    int redraw;
+    int key;
+    int sign_key;
+    Ring lines;
+    SignList signs;
+} ChunkBatch;
+
 typedef struct {
     float x;
     float y;
@@ -97,6 +152,10 @@ typedef struct {
     State state;
     State state1;
     State state2;
+    State last;
+    float vx;
+    float vz;
+    float vrx;
     GLuint buffer;
 } Player;
 
@@ -118,8 +177,19 @@ typedef struct {
 typedef struct {
     GLFWwindow *window;
     Worker workers[WORKERS];
+    Stage stages[STAGES];
+    Queue completed;
+    WorkerItem *finished;
+    int load_jobs;
+    int mesh_jobs;
+    int store_jobs;
+    ColdCache cold;
     Chunk chunks[MAX_CHUNKS];
     int chunk_count;
+    int chunk_id;
+    Chunk *deleted;
+    int deleted_count;
+    int deleted_capacity;
     int create_radius;
     int render_radius;
     int delete_radius;
@@ -146,11 +216,33 @@ typedef struct {
     char server_addr[MAX_ADDR_LENGTH];
     int server_port;
     int day_length;
+    double day_time;
     int time_changed;
     Block block0;
     Block block1;
     Block copy0;
     Block copy1;
+    Ring edits;
+    KeyMap keys;
+    int sign_keys;
+    int protocol;
+    ChunkBatch *batches;
+    int batch_count;
+    int batch_capacity;
+    double budget;
+    int auto_view;
+    int view_hold;
+    int view_frames;
+    int view_backlog;
+    double view_time;
+    double view_work;
+    double stats_time;
+    double unready;
+    int stats_chunks;
+    int place_player;
+    float frame_times[FRAME_SAMPLES];
+    int frame_index;
+    int frame_count;
 } Model;
 
 static Model model;
@@ -955,7 +1047,7 @@ void light_fill(
     light_fill(opaque, light, x, y, z + 1, w, 0);
 }
 
-void compute_chunk(WorkerItem *item) {
+void compute_volume(WorkerItem *item) {
     char *opaque = (char *)calloc(XZ_SIZE * XZ_SIZE * Y_SIZE, sizeof(char));
     char *light = (char *)calloc(XZ_SIZE * XZ_SIZE * Y_SIZE, sizeof(char));
     char *highest = (char *)calloc(XZ_SIZE * XZ_SIZE, sizeof(char));
@@ -964,19 +1056,6 @@ void compute_chunk(WorkerItem *item) {
     int oy = -1;
     int oz = item->q * CHUNK_SIZE - CHUNK_SIZE - 1;
 
-    // check for lights
-    int has_light = 0;
-    if (SHOW_LIGHTS) {
-        for (int a = 0; a < 3; a++) {
-            for (int b = 0; b < 3; b++) {
-                Map *map = item->light_maps[a][b];
-                if (map && map->size) {
-                    has_light = 1;
-                }
-            }
-        }
-    }
-
     // populate opaque array
     for (int a = 0; a < 3; a++) {
         for (int b = 0; b < 3; b++) {
@@ -1005,6 +1084,32 @@ void compute_chunk(WorkerItem *item) {
         }
     }
 
+    item->opaque = opaque;
+    item->light = light;
+    item->highest = highest;
+}
+
+void compute_light(WorkerItem *item) {
+    char *opaque = item->opaque;
+    char *light = item->light;
+
+    int ox = item->p * CHUNK_SIZE - CHUNK_SIZE - 1;
+    int oy = -1;
+    int oz = item->q * CHUNK_SIZE - CHUNK_SIZE - 1;
+
+    // check for lights
+    int has_light = 0;
+    if (SHOW_LIGHTS) {
+        for (int a = 0; a < 3; a++) {
+            for (int b = 0; b < 3; b++) {
+                Map *map = item->light_maps[a][b];
+                if (map && map->size) {
+                    has_light = 1;
+                }
+            }
+        }
+    }
+
     // flood fill light intensities
     if (has_light) {
         for (int a = 0; a < 3; a++) {
@@ -1022,6 +1127,16 @@ void compute_chunk(WorkerItem *item) {
             }
         }
     }
+}
+
+void compute_faces(WorkerItem *item, WorkerItem *out, int y0, int y1) {
+    char *opaque = item->opaque;
+    char *light = item->light;
+    char *highest = item->highest;
+
+    int ox = item->p * CHUNK_SIZE - CHUNK_SIZE - 1;
+    int oy = -1;
+    int oz = item->q * CHUNK_SIZE - CHUNK_SIZE - 1;
 
     Map *map = item->block_maps[1][1];
 
@@ -1030,7 +1145,7 @@ void compute_chunk(WorkerItem *item) {
     int maxy = 0;
     int faces = 0;
     MAP_FOR_EACH(map, ex, ey, ez, ew) {
-        if (ew <= 0) {
+        if (ew <= 0 || ey < y0 || ey >= y1) {
             continue;
         }
         int x = ex - ox;
@@ -1058,7 +1173,7 @@ void compute_chunk(WorkerItem *item) {
     GLfloat *data = malloc_faces(10, faces);
     int offset = 0;
     MAP_FOR_EACH(map, ex, ey, ez, ew) {
-        if (ew <= 0) {
+        if (ew <= 0 || ey < y0 || ey >= y1) {
             continue;
         }
         int x = ex - ox;
@@ -1123,49 +1238,126 @@ void compute_chunk(WorkerItem *item) {
         offset += total * 60;
     } END_MAP_FOR_EACH;
 
-    free(opaque);
-    free(light);
-    free(highest);
+    out->miny = miny;
+    out->maxy = maxy;
+    out->faces = faces;
+    out->data = data;
+}
+
+void free_volume(WorkerItem *item) {
+    free(item->opaque);
+    free(item->light);
+    free(item->highest);
+    item->opaque = 0;
+    item->light = 0;
+    item->highest = 0;
+}
+
+void compute_mesh(WorkerItem *item) {
+    compute_faces(item, item, 0, 256);
+    free_volume(item);
+}
+
+void split_slabs(WorkerItem *item) {
+    // balance the slabs by the number of exposed blocks at each height
+    char *opaque = item->opaque;
+    int ox = item->p * CHUNK_SIZE - CHUNK_SIZE - 1;
+    int oy = -1;
+    int oz = item->q * CHUNK_SIZE - CHUNK_SIZE - 1;
+    int counts[256] = {0};
+    int total = 0;
+    Map *map = item->block_maps[1][1];
+    MAP_FOR_EACH(map, ex, ey, ez, ew) {
+        if (ew <= 0 || ey < 0 || ey >= 256) {
+            continue;
+        }
+        int x = ex - ox;
+        int y = ey - oy;
+        int z = ez - oz;
+        if (opaque[XYZ(x - 1, y, z)] && opaque[XYZ(x + 1, y, z)] &&
+            opaque[XYZ(x, y + 1, z)] &&
+            (ey == 0 || opaque[XYZ(x, y - 1, z)]) &&
+            opaque[XYZ(x, y, z - 1)] && opaque[XYZ(x, y, z + 1)])
+        {
+            continue;
+        }
+        counts[ey]++;
+        total++;
+    } END_MAP_FOR_EACH;
+    int n = item->slab_count;
+    WorkerItem *slabs = (WorkerItem *)calloc(n, sizeof(WorkerItem));
+    int y = 0;
+    int sum = 0;
+    for (int i = 0; i < n; i++) {
+        WorkerItem *slab = slabs + i;
+        slab->parent = item;
+        slab->stage = STAGE_MESH;
+        slab->priority = item->priority;
+        slab->y0 = y;
+        int target = total * (i + 1) / n;
+        while (y < 256 && (sum < target || i == n - 1)) {
+            sum += counts[y++];
+        }
+        slab->y1 = y;
+    }
+    item->slabs = slabs;
+    item->pending = n;
+}
 
+void stitch_slabs(WorkerItem *item) {
+    int n = item->slab_count;
+    int miny = 256;
+    int maxy = 0;
+    int faces = 0;
+    for (int i = 0; i < n; i++) {
+        WorkerItem *slab = item->slabs + i;
+        miny = MIN(miny, slab->miny);
+        maxy = MAX(maxy, slab->maxy);
+        faces += slab->faces;
+    }
+    GLfloat *data = malloc_faces(10, faces);
+    int offset = 0;
+    for (int i = 0; i < n; i++) {
+        WorkerItem *slab = item->slabs + i;
+        memcpy(data + offset, slab->data, sizeof(GLfloat) * slab->faces * 60);
+        offset += slab->faces * 60;
+        free(slab->data);
+    }
+    free(item->slabs);
+    item->slabs = 0;
+    free_volume(item);
     item->miny = miny;
     item->maxy = maxy;
     item->faces = faces;
     item->data = data;
 }
 
+void compute_slab(WorkerItem *slab) {
+    WorkerItem *item = slab->parent;
+    compute_faces(item, slab, slab->y0, slab->y1);
+    if (ATOMIC_SUB(&item->pending, 1) == 0) {
+        stitch_slabs(item);
+        queue_push(&g->completed, &item->node);
+    }
+}
+
 void generate_chunk(Chunk *chunk, WorkerItem *item) {
     chunk->miny = item->miny;
     chunk->maxy = item->maxy;
     chunk->faces = item->faces;
     del_buffer(chunk->buffer);
-    chunk->buffer = gen_faces(10, item->faces, item->data);
-    gen_sign_buffer(chunk);
-}
-
-void gen_chunk_buffer(Chunk *chunk) {
-    WorkerItem _item;
-    WorkerItem *item = &_item;
-    item->p = chunk->p;
-    item->q = chunk->q;
-    for (int dp = -1; dp <= 1; dp++) {
-        for (int dq = -1; dq <= 1; dq++) {
-            Chunk *other = chunk;
-            if (dp || dq) {
-                other = find_chunk(chunk->p + dp, chunk->q + dq);
-            }
-            if (other) {
-                item->block_maps[dp + 1][dq + 1] = &other->map;
-                item->light_maps[dp + 1][dq + 1] = &other->lights;
-            }
-            else {
-                item->block_maps[dp + 1][dq + 1] = 0;
-                item->light_maps[dp + 1][dq + 1] = 0;
-            }
-        }
+    free(chunk->mesh);
+    chunk->mesh = 0;
+    if (COLD_CACHE_SIZE && COLD_CACHE_MESHES) {
+        // kept for the cold cache, evictions do not read the gpu back
+        chunk->buffer = gen_buffer(
+            sizeof(GLfloat) * 60 * item->faces, item->data);
+        chunk->mesh = item->data;
     }
-    compute_chunk(item);
-    generate_chunk(chunk, item);
-    chunk->dirty = 0;
+    else {
+        chunk->buffer = gen_faces(10, item->faces, item->data);
+    }
+    gen_sign_buffer(chunk);
 }
 
 void map_set_func(int x, int y, int z, int w, void *arg) {
@@ -1173,19 +1365,94 @@ void map_set_func(int x, int y, int z, int w, void *arg) {
     map_set(map, x, y, z, w);
 }
 
+void generate_terrain(WorkerItem *item) {
+    create_world(item->p, item->q, map_set_func, item->block_maps[1][1]);
+}
+
+int load_cold(WorkerItem *item) {
+    // restores an evicted chunk, with its mesh if that was kept too
+    ColdEntry *entry = item->cold;
+    Map *block_map = item->block_maps[1][1];
+    Map *light_map = item->light_maps[1][1];
+    int result = cold_unpack(entry, block_map, light_map, &item->signs);
+    if (result == 0) {
+        item->data = cold_unpack_mesh(entry);
+        item->faces = entry->faces;
+        item->miny = entry->miny;
+        item->maxy = entry->maxy;
+    }
+    cold_entry_free(entry);
+    item->cold = 0;
+    return result;
+}
+
 void load_chunk(WorkerItem *item) {
     int p = item->p;
     int q = item->q;
+    if (item->cold) {
+        if (load_cold(item) == 0) {
+            return;
+        }
+        generate_terrain(item);
+    }
     Map *block_map = item->block_maps[1][1];
     Map *light_map = item->light_maps[1][1];
-    create_world(p, q, map_set_func, block_map);
     db_load_blocks(block_map, p, q);
     db_load_lights(light_map, p, q);
+    db_load_signs(&item->signs, p, q);
 }
 
-void request_chunk(int p, int q) {
-    int key = db_get_key(p, q);
-    client_chunk(p, q, key);
+void load_band(WorkerItem *item) {
+    int p0 = item->p;
+    int q0 = item->q;
+    int p1 = p0;
+    int q1 = q0;
+    for (WorkerItem *e = item->band; e; e = e->next) {
+        p0 = MIN(p0, e->p);
+        q0 = MIN(q0, e->q);
+        p1 = MAX(p1, e->p);
+        q1 = MAX(q1, e->q);
+    }
+    int n = (p1 - p0 + 1) * (q1 - q0 + 1);
+    Map **block_maps = (Map **)calloc(n, sizeof(Map *));
+    Map **light_maps = (Map **)calloc(n, sizeof(Map *));
+    SignList **sign_lists = (SignList **)calloc(n, sizeof(SignList *));
+    for (WorkerItem *e = item->band; e; e = e->next) {
+        if (e->cold) {
+            if (load_cold(e) == 0) {
+                continue;
+            }
+            generate_terrain(e);
+        }
+        int index = (e->p - p0) * (q1 - q0 + 1) + (e->q - q0);
+        block_maps[index] = e->block_maps[1][1];
+        light_maps[index] = e->light_maps[1][1];
+        sign_lists[index] = &e->signs;
+    }
+    db_load_range(p0, q0, p1, q1, block_maps, light_maps, sign_lists);
+    free(block_maps);
+    free(light_maps);
+    free(sign_lists);
+}
+
+void install_signs(Chunk *chunk, SignList *signs) {
+    // signs placed while the chunk was loading win over the stored ones
+    SignList *list = &chunk->signs;
+    for (int i = 0; i < list->size; i++) {
+        Sign *e = list->data + i;
+        sign_list_add(signs, e->x, e->y, e->z, e->face, e->text);
+    }
+    sign_list_free(list);
+    memcpy(list, signs, sizeof(SignList));
+    signs->data = 0;
+}
+
+void alloc_chunk_maps(Map *block_map, Map *light_map, int p, int q) {
+    int dx = p * CHUNK_SIZE - 1;
+    int dy = 0;
+    int dz = q * CHUNK_SIZE - 1;
+    map_alloc(block_map, dx, dy, dz, 0x7fff);
+    map_alloc(light_map, dx, dy, dz, 0xf);
 }
 
 void init_chunk(Chunk *chunk, int p, int q) {
@@ -1195,31 +1462,33 @@ void init_chunk(Chunk *chunk, int p, int q) {
     chunk->sign_faces = 0;
     chunk->buffer = 0;
     chunk->sign_buffer = 0;
+    chunk->mesh = 0;
+    chunk->id = ++g->chunk_id;
+    chunk->loaded = 0;
+    chunk->busy = 0;
+    chunk->forced = 0;
+    chunk->edited = 0;
     dirty_chunk(chunk);
-    SignList *signs = &chunk->signs;
-    sign_list_alloc(signs, 16);
-    db_load_signs(signs, p, q);
-    Map *block_map = &chunk->map;
-    Map *light_map = &chunk->lights;
-    int dx = p * CHUNK_SIZE - 1;
-    int dy = 0;
-    int dz = q * CHUNK_SIZE - 1;
-    map_alloc(block_map, dx, dy, dz, 0x7fff);
-    map_alloc(light_map, dx, dy, dz, 0xf);
+    sign_list_alloc(&chunk->signs, 16);
+    alloc_chunk_maps(&chunk->map, &chunk->lights, p, q);
 }
 
-void create_chunk(Chunk *chunk, int p, int q) {
-    init_chunk(chunk, p, q);
+int over_budget(double start) {
+    double elapsed = glfwGetTime() - start;
+    return elapsed > FRAME_SLICE && elapsed > g->budget;
+}
 
-    WorkerItem _item;
-    WorkerItem *item = &_item;
-    item->p = chunk->p;
-    item->q = chunk->q;
-    item->block_maps[1][1] = &chunk->map;
-    item->light_maps[1][1] = &chunk->lights;
-    load_chunk(item);
+void spend_budget(double start) {
+    g->budget -= glfwGetTime() - start;
+}
 
-    request_chunk(p, q);
+void free_chunk(Chunk *chunk) {
+    map_free(&chunk->map);
+    map_free(&chunk->lights);
+    sign_list_free(&chunk->signs);
+    del_buffer(chunk->buffer);
+    del_buffer(chunk->sign_buffer);
+    free(chunk->mesh);
 }
 
 void delete_chunks() {
@@ -1241,11 +1510,12 @@ void delete_chunks() {
             }
         }
         if (delete) {
-            map_free(&chunk->map);
-            map_free(&chunk->lights);
-            sign_list_free(&chunk->signs);
-            del_buffer(chunk->buffer);
-            del_buffer(chunk->sign_buffer);
+            if (g->deleted_count == g->deleted_capacity) {
+                g->deleted_capacity = MAX(g->deleted_capacity * 2, 64);
+                g->deleted = (Chunk *)realloc(
+                    g->deleted, sizeof(Chunk) * g->deleted_capacity);
+            }
+            memcpy(g->deleted + g->deleted_count++, chunk, sizeof(Chunk));
             Chunk *other = g->chunks + (--count);
             memcpy(chunk, other, sizeof(Chunk));
         }
@@ -1253,82 +1523,504 @@ void delete_chunks() {
     g->chunk_count = count;
 }
 
+void invalidate_cold(int p, int q) {
+    // an edit makes the cached copy of its chunk stale, and the cached
+    // meshes around it, which show its border blocks and its lights
+    cold_cache_remove(&g->cold, p, q);
+    for (int dp = -1; dp <= 1; dp++) {
+        for (int dq = -1; dq <= 1; dq++) {
+            if (dp || dq) {
+                cold_cache_drop_mesh(&g->cold, p + dp, q + dq);
+            }
+        }
+    }
+}
+
 void delete_all_chunks() {
     for (int i = 0; i < g->chunk_count; i++) {
-        Chunk *chunk = g->chunks + i;
-        map_free(&chunk->map);
-        map_free(&chunk->lights);
-        sign_list_free(&chunk->signs);
-        del_buffer(chunk->buffer);
-        del_buffer(chunk->sign_buffer);
+        free_chunk(g->chunks + i);
     }
     g->chunk_count = 0;
+    while (g->deleted_count) {
+        free_chunk(g->deleted + (--g->deleted_count));
+    }
 }
 
-void check_workers() {
-    for (int i = 0; i < WORKERS; i++) {
-        Worker *worker = g->workers + i;
-        mtx_lock(&worker->mtx);
-        if (worker->state == WORKER_DONE) {
-            WorkerItem *item = &worker->item;
-            Chunk *chunk = find_chunk(item->p, item->q);
-            if (chunk) {
-                if (item->load) {
-                    Map *block_map = item->block_maps[1][1];
-                    Map *light_map = item->light_maps[1][1];
-                    map_free(&chunk->map);
-                    map_free(&chunk->lights);
-                    map_copy(&chunk->map, block_map);
-                    map_copy(&chunk->lights, light_map);
-                    request_chunk(item->p, item->q);
-                }
+void stage_put(Stage *stage, WorkerItem *item) {
+    mtx_lock(&stage->mtx);
+    WorkerItem **link = &stage->head;
+    while (*link && (*link)->priority <= item->priority) {
+        link = &(*link)->next;
+    }
+    item->next = *link;
+    *link = item;
+    cnd_signal(&stage->cnd);
+    mtx_unlock(&stage->mtx);
+}
+
+WorkerItem *stage_get(Stage *stage) {
+    mtx_lock(&stage->mtx);
+    while (!stage->head) {
+        cnd_wait(&stage->cnd, &stage->mtx);
+    }
+    WorkerItem *item = stage->head;
+    stage->head = item->next;
+    mtx_unlock(&stage->mtx);
+    return item;
+}
+
+void submit_item(WorkerItem *item, int stage) {
+    item->stage = stage;
+    stage_put(g->stages + stage, item);
+}
+
+void free_item(WorkerItem *item) {
+    for (int a = 0; a < 3; a++) {
+        for (int b = 0; b < 3; b++) {
+            Map *block_map = item->block_maps[a][b];
+            Map *light_map = item->light_maps[a][b];
+            if (block_map) {
+                map_free(block_map);
+                free(block_map);
+            }
+            if (light_map) {
+                map_free(light_map);
+                free(light_map);
+            }
+        }
+    }
+    free(item->opaque);
+    free(item->light);
+    free(item->highest);
+    free(item->data);
+    sign_list_free(&item->signs);
+    if (item->cold) {
+        cold_entry_free(item->cold);
+    }
+    free(item);
+}
+
+void store_chunk(Chunk *chunk) {
+    // loaded chunks are packed into the cold cache by the store worker,
+    // along with their mesh, those past MAX_STORE_JOBS are just freed
+    if (!COLD_CACHE_SIZE || !chunk->loaded ||
+        g->store_jobs >= MAX_STORE_JOBS)
+    {
+        free_chunk(chunk);
+        return;
+    }
+    WorkerItem *item = (WorkerItem *)calloc(1, sizeof(WorkerItem));
+    item->id = chunk->id;
+    item->p = chunk->p;
+    item->q = chunk->q;
+    Map *block_map = malloc(sizeof(Map));
+    Map *light_map = malloc(sizeof(Map));
+    memcpy(block_map, &chunk->map, sizeof(Map));
+    memcpy(light_map, &chunk->lights, sizeof(Map));
+    item->block_maps[1][1] = block_map;
+    item->light_maps[1][1] = light_map;
+    memcpy(&item->signs, &chunk->signs, sizeof(SignList));
+    if (chunk->mesh && !chunk->dirty && !chunk->busy) {
+        item->faces = chunk->faces;
+        item->miny = chunk->miny;
+        item->maxy = chunk->maxy;
+        item->data = chunk->mesh;
+        chunk->mesh = 0;
+    }
+    free(chunk->mesh);
+    del_buffer(chunk->buffer);
+    del_buffer(chunk->sign_buffer);
+    cold_cache_reserve(&g->cold, chunk->p, chunk->q, chunk->id);
+    g->store_jobs++;
+    submit_item(item, STAGE_STORE);
+}
+
+void pack_chunk(WorkerItem *item) {
+    item->cold = cold_pack(item->p, item->q, item->id,
+        item->block_maps[1][1], item->light_maps[1][1], &item->signs);
+    if (item->data) {
+        cold_pack_mesh(
+            item->cold, item->data, item->faces, item->miny, item->maxy);
+        free(item->data);
+        item->data = 0;
+    }
+}
+
+void free_deleted_chunks() {
+    double start = glfwGetTime();
+    while (g->deleted_count && !over_budget(start)) {
+        store_chunk(g->deleted + (--g->deleted_count));
+    }
+    spend_budget(start);
+}
+
+ChunkBatch *find_batch(int p, int q) {
+    // answers come back in request order, the oldest batch is usually it
+    for (int i = 0; i < g->batch_count; i++) {
+        ChunkBatch *batch = g->batches + i;
+        if (batch->p == p && batch->q == q) {
+            return batch;
+        }
+    }
+    return 0;
+}
+
+void open_batch(int p, int q, int key, int sign_key) {
+    if (g->batch_count == g->batch_capacity) {
+        g->batch_capacity = MAX(g->batch_capacity * 2, 64);
+        g->batches = (ChunkBatch *)realloc(
+            g->batches, sizeof(ChunkBatch) * g->batch_capacity);
+    }
+    ChunkBatch *batch = g->batches + g->batch_count++;
+    batch->p = p;
+    batch->q = q;
+    batch->redraw = 0;
+    batch->key = key;
+    batch->sign_key = sign_key;
+    ring_alloc(&batch->lines, 16);
+    sign_list_alloc(&batch->signs, 4);
+}
+
+void close_batch(ChunkBatch *batch) {
+    ring_free(&batch->lines);
+    sign_list_free(&batch->signs);
+    int index = batch - g->batches;
+    g->batch_count--;
+    memmove(batch, batch + 1,
+        sizeof(ChunkBatch) * (g->batch_count - index));
+}
+
+void free_batches() {
+    while (g->batch_count) {
+        close_batch(g->batches);
+    }
+}
+
+void request_chunk(int p, int q) {
+    int sign_key;
+    int key = key_map_get(&g->keys, p, q, &sign_key);
+    if (!g->sign_keys) {
+        sign_key = -1;
+    }
+    if (g->mode == MODE_ONLINE && !find_batch(p, q)) {
+        // the B, L, S and R lines of the answer are held until its C line
+        open_batch(p, q, key, sign_key);
+    }
+    client_chunk(p, q, key, sign_key);
+    db_access_chunk(p, q);
+}
+
+void load_key(int p, int q, int key, int sign_key, void *arg) {
+    key_map_set((KeyMap *)arg, p, q, key, sign_key, 0);
+}
+
+void evict_chunk(int p, int q, void *arg) {
+    // chunks in use stay, their key is reset before the rows go so that
+    // the next request asks for everything
+    if (find_chunk(p, q) || find_batch(p, q)) {
+        db_access_chunk(p, q);
+        return;
+    }
+    key_map_set(&g->keys, p, q, 0, 0, 0);
+    db_evict_chunk(p, q);
+}
+
+void flush_keys() {
+    // K messages only update the cache, changed keys are written back
+    // with each commit
+    KeyMap *map = &g->keys;
+    for (unsigned int i = 0; i <= map->mask; i++) {
+        KeyEntry *entry = map->data + i;
+        if (entry->dirty) {
+            db_set_key(entry->p, entry->q, entry->key, entry->sign_key);
+            entry->dirty = 0;
+        }
+    }
+}
+
+void finish_item(WorkerItem *item) {
+    if (item->stage == STAGE_STORE) {
+        g->store_jobs--;
+        cold_cache_fill(&g->cold, item->cold);
+        item->cold = 0;
+        free_item(item);
+        return;
+    }
+    Chunk *chunk = find_chunk(item->p, item->q);
+    if (chunk && chunk->id != item->id) {
+        chunk = 0;
+    }
+    if (item->stage == STAGE_LOAD) {
+        g->load_jobs--;
+        if (chunk) {
+            map_free(&chunk->map);
+            map_free(&chunk->lights);
+            memcpy(&chunk->map, item->block_maps[1][1], sizeof(Map));
+            memcpy(&chunk->lights, item->light_maps[1][1], sizeof(Map));
+            free(item->block_maps[1][1]);
+            free(item->light_maps[1][1]);
+            item->block_maps[1][1] = 0;
+            item->light_maps[1][1] = 0;
+            install_signs(chunk, &item->signs);
+            chunk->loaded = 1;
+            chunk->busy = 0;
+            if (item->data) {
                 generate_chunk(chunk, item);
+                item->data = 0;
+                chunk->dirty = 0;
             }
-            for (int a = 0; a < 3; a++) {
-                for (int b = 0; b < 3; b++) {
-                    Map *block_map = item->block_maps[a][b];
-                    Map *light_map = item->light_maps[a][b];
-                    if (block_map) {
-                        map_free(block_map);
-                        free(block_map);
-                    }
-                    if (light_map) {
-                        map_free(light_map);
-                        free(light_map);
-                    }
-                }
+            request_chunk(item->p, item->q);
+        }
+    }
+    else {
+        g->mesh_jobs--;
+        if (chunk) {
+            generate_chunk(chunk, item);
+            item->data = 0;
+            chunk->busy = 0;
+        }
+    }
+    free_item(item);
+}
+
+void check_workers(Player *player) {
+    QueueNode *node;
+    while ((node = queue_pop(&g->completed))) {
+        WorkerItem *item = (WorkerItem *)node;
+        item->next = g->finished;
+        g->finished = item;
+    }
+    int p = chunked(player->state.x);
+    int q = chunked(player->state.z);
+    double start = glfwGetTime();
+    while (g->finished && !over_budget(start)) {
+        WorkerItem **best = 0;
+        int best_distance = 0;
+        for (WorkerItem **link = &g->finished; *link; link = &(*link)->next) {
+            int dp = ABS((*link)->p - p);
+            int dq = ABS((*link)->q - q);
+            int distance = MAX(dp, dq);
+            if (!best || distance < best_distance) {
+                best = link;
+                best_distance = distance;
             }
-            worker->state = WORKER_IDLE;
         }
-        mtx_unlock(&worker->mtx);
+        WorkerItem *item = *best;
+        *best = item->next;
+        finish_item(item);
     }
+    spend_budget(start);
+}
+
+void drain_workers() {
+    // queued store jobs are dropped, the cold cache is cleared next
+    Stage *stage = g->stages + STAGE_STORE;
+    mtx_lock(&stage->mtx);
+    WorkerItem *item = stage->head;
+    stage->head = 0;
+    mtx_unlock(&stage->mtx);
+    while (item) {
+        WorkerItem *next = item->next;
+        g->store_jobs--;
+        free_item(item);
+        item = next;
+    }
+    while (g->load_jobs || g->mesh_jobs || g->store_jobs) {
+        check_workers(g->players);
+        thrd_yield();
+    }
+}
+
+WorkerItem *load_item(Chunk *chunk, int priority) {
+    WorkerItem *item = (WorkerItem *)calloc(1, sizeof(WorkerItem));
+    item->priority = priority;
+    item->id = chunk->id;
+    item->p = chunk->p;
+    item->q = chunk->q;
+    Map *block_map = malloc(sizeof(Map));
+    Map *light_map = malloc(sizeof(Map));
+    alloc_chunk_maps(block_map, light_map, chunk->p, chunk->q);
+    item->block_maps[1][1] = block_map;
+    item->light_maps[1][1] = light_map;
+    sign_list_alloc(&item->signs, 16);
+    item->cold = cold_cache_take(&g->cold, chunk->p, chunk->q);
+    chunk->busy = 1;
+    g->load_jobs++;
+    return item;
+}
+
+void submit_load(Chunk *chunk, int priority) {
+    submit_item(load_item(chunk, priority), STAGE_GENERATE);
+}
+
+void submit_mesh(Chunk *chunk, int priority, int slabs) {
+    WorkerItem *item = (WorkerItem *)calloc(1, sizeof(WorkerItem));
+    item->priority = priority;
+    item->slab_count = slabs;
+    item->id = chunk->id;
+    item->p = chunk->p;
+    item->q = chunk->q;
+    for (int dp = -1; dp <= 1; dp++) {
+        for (int dq = -1; dq <= 1; dq++) {
+            Chunk *other = chunk;
+            if (dp || dq) {
+                other = find_chunk(chunk->p + dp, chunk->q + dq);
+            }
+            if (other && other->loaded) {
+                Map *block_map = malloc(sizeof(Map));
+                map_copy(block_map, &other->map);
+                Map *light_map = malloc(sizeof(Map));
+                map_copy(light_map, &other->lights);
+                item->block_maps[dp + 1][dq + 1] = block_map;
+                item->light_maps[dp + 1][dq + 1] = light_map;
+            }
+        }
+    }
+    chunk->dirty = 0;
+    chunk->edited = 0;
+    chunk->busy = 1;
+    g->mesh_jobs++;
+    // chunks without lights skip the light stage entirely
+    submit_item(item, has_lights(chunk) ? STAGE_LIGHT : STAGE_MESH);
+}
+
+int neighbors_loaded(Chunk *chunk) {
+    for (int dp = -1; dp <= 1; dp++) {
+        for (int dq = -1; dq <= 1; dq++) {
+            if (!dp && !dq) {
+                continue;
+            }
+            Chunk *other = find_chunk(chunk->p + dp, chunk->q + dq);
+            if (other && !other->loaded) {
+                return 0;
+            }
+            if (!other && g->chunk_count < MAX_CHUNKS) {
+                return 0;
+            }
+        }
+    }
+    return 1;
 }
 
 void force_chunks(Player *player) {
     State *s = &player->state;
     int p = chunked(s->x);
     int q = chunked(s->z);
-    int r = 1;
+    // collision only needs the block data of the player's own chunk, it
+    // is loaded ahead of everything else and movement waits for it
+    int r = 2;
+    Chunk *chunk = find_chunk(p, q);
+    if (!chunk && g->chunk_count < MAX_CHUNKS) {
+        chunk = g->chunks + g->chunk_count++;
+        init_chunk(chunk, p, q);
+        chunk->forced = 1;
+        submit_load(chunk, -r - 1);
+    }
+    else if (chunk && !chunk->loaded && !chunk->forced) {
+        // replaces the chunk id, the queued load is dropped
+        map_free(&chunk->map);
+        map_free(&chunk->lights);
+        sign_list_free(&chunk->signs);
+        init_chunk(chunk, p, q);
+        chunk->forced = 1;
+        submit_load(chunk, -r - 1);
+    }
+    // the rest is queued ahead of regular streaming (negative priority),
+    // loading one ring further so the inner 3x3 can be meshed
     for (int dp = -r; dp <= r; dp++) {
         for (int dq = -r; dq <= r; dq++) {
             int a = p + dp;
             int b = q + dq;
+            int distance = MAX(ABS(dp), ABS(dq));
+            int priority = distance - r - 1;
             Chunk *chunk = find_chunk(a, b);
-            if (chunk) {
-                if (chunk->dirty) {
-                    gen_chunk_buffer(chunk);
+            if (!chunk) {
+                if (g->chunk_count < MAX_CHUNKS) {
+                    chunk = g->chunks + g->chunk_count++;
+                    init_chunk(chunk, a, b);
+                    submit_load(chunk, priority);
                 }
+                continue;
+            }
+            if (distance == r || chunk->busy) {
+                continue;
             }
-            else if (g->chunk_count < MAX_CHUNKS) {
-                chunk = g->chunks + g->chunk_count++;
-                create_chunk(chunk, a, b);
-                gen_chunk_buffer(chunk);
+            if (!chunk->loaded || !chunk->dirty) {
+                continue;
+            }
+            if (neighbors_loaded(chunk)) {
+                // the player's own chunk and fresh edits are split across
+                // the mesh workers so the new geometry shows up sooner
+                int urgent = distance == 0 || chunk->edited;
+                submit_mesh(chunk, priority, urgent ? MESH_SLABS : 1);
             }
         }
     }
 }
 
-void ensure_chunks_worker(Player *player, Worker *worker) {
+typedef struct {
+    int score;
+    int focus;
+    int a;
+    int b;
+    Chunk *chunk;
+} Candidate;
+
+int candidate_compare(const void *a, const void *b) {
+    return ((Candidate *)a)->score - ((Candidate *)b)->score;
+}
+
+void update_motion(Player *player, float dt) {
+    State *s = &player->state;
+    State *l = &player->last;
+    float dx = s->x - l->x;
+    float dz = s->z - l->z;
+    float drx = s->rx - l->rx;
+    if (drx > PI) {
+        drx -= 2 * PI;
+    }
+    if (drx < -PI) {
+        drx += 2 * PI;
+    }
+    memcpy(l, s, sizeof(State));
+    if (dt <= 0) {
+        return;
+    }
+    if (ABS(dx) > CHUNK_SIZE || ABS(dz) > CHUNK_SIZE) {
+        // teleported
+        player->vx = 0;
+        player->vz = 0;
+        player->vrx = 0;
+        return;
+    }
+    float a = 1 - expf(-dt / 0.25);
+    player->vx += (dx / dt - player->vx) * a;
+    player->vz += (dz / dt - player->vz) * a;
+    player->vrx += (drx / dt - player->vrx) * a;
+}
+
+int predict_path(Player *player, int path[][2]) {
+    State *s = &player->state;
+    path[0][0] = chunked(s->x);
+    path[0][1] = chunked(s->z);
+    float speed = sqrtf(player->vx * player->vx + player->vz * player->vz);
+    if (speed < 1) {
+        return 1;
+    }
+    float distance = MIN(
+        speed * PREFETCH_TIME, PREFETCH_CHUNKS * CHUNK_SIZE);
+    int steps = distance / CHUNK_SIZE;
+    for (int i = 1; i <= steps; i++) {
+        float d = i * CHUNK_SIZE / speed;
+        path[i][0] = chunked(s->x + player->vx * d);
+        path[i][1] = chunked(s->z + player->vz * d);
+    }
+    return steps + 1;
+}
+
+Candidate *add_candidates(
+    Candidate *candidates, int *count, Player *player, int focus)
+{
     State *s = &player->state;
     float matrix[16];
     set_matrix_3d(
@@ -1336,115 +2028,284 @@ void ensure_chunks_worker(Player *player, Worker *worker) {
         s->x, s->y, s->z, s->rx, s->ry, g->fov, g->ortho, g->render_radius);
     float planes[6][4];
     frustum_planes(planes, g->render_radius, matrix);
-    int p = chunked(s->x);
-    int q = chunked(s->z);
-    int r = g->create_radius;
-    int start = 0x0fffffff;
-    int best_score = start;
-    int best_a = 0;
-    int best_b = 0;
-    for (int dp = -r; dp <= r; dp++) {
-        for (int dq = -r; dq <= r; dq++) {
-            int a = p + dp;
-            int b = q + dq;
-            int index = (ABS(a) ^ ABS(b)) % WORKERS;
-            if (index != worker->index) {
-                continue;
+    // where the player is headed and where they will be looking, unless
+    // prefetching is turned off
+    int path[PREFETCH_CHUNKS + 1][2];
+    int steps = predict_path(player, path);
+    float predicted[6][4];
+    if (PREFETCH_CHUNKS) {
+        float turn = player->vrx * PREFETCH_TIME;
+        turn = MAX(turn, -RADIANS(90));
+        turn = MIN(turn, RADIANS(90));
+        set_matrix_3d(
+            matrix, g->width, g->height,
+            s->x + player->vx * PREFETCH_TIME, s->y,
+            s->z + player->vz * PREFETCH_TIME, s->rx + turn, s->ry,
+            g->fov, g->ortho, g->render_radius);
+        frustum_planes(predicted, g->render_radius, matrix);
+    }
+    // terrain is loaded one ring ahead of meshing so that neighbors
+    // are available by the time a chunk is meshed
+    int r = g->create_radius + 1;
+    int p0 = path[0][0];
+    int q0 = path[0][1];
+    int p1 = p0;
+    int q1 = q0;
+    for (int i = 1; i < steps; i++) {
+        p0 = MIN(p0, path[i][0]);
+        q0 = MIN(q0, path[i][1]);
+        p1 = MAX(p1, path[i][0]);
+        q1 = MAX(q1, path[i][1]);
+    }
+    int n = (p1 - p0 + r * 2 + 1) * (q1 - q0 + r * 2 + 1);
+    candidates = (Candidate *)realloc(
+        candidates, sizeof(Candidate) * (*count + n));
+    for (int a = p0 - r; a <= p1 + r; a++) {
+        for (int b = q0 - r; b <= q1 + r; b++) {
+            // reach: distance to the nearest point on the path
+            // distance: chunks of travel until the chunk is needed
+            int reach = r + 1;
+            int distance = 0x7fff;
+            for (int i = 0; i < steps; i++) {
+                int d = MAX(ABS(a - path[i][0]), ABS(b - path[i][1]));
+                reach = MIN(reach, d);
+                distance = MIN(distance, d + i);
             }
-            Chunk *chunk = find_chunk(a, b);
-            if (chunk && !chunk->dirty) {
+            if (reach > r) {
                 continue;
             }
-            int distance = MAX(ABS(dp), ABS(dq));
-            int invisible = !chunk_visible(planes, a, b, 0, 256);
-            int priority = 0;
+            Chunk *chunk = find_chunk(a, b);
             if (chunk) {
-                priority = chunk->buffer && chunk->dirty;
-            }
-            int score = (invisible << 24) | (priority << 16) | distance;
-            if (score < best_score) {
-                best_score = score;
-                best_a = a;
-                best_b = b;
+                if (reach == r || chunk->busy) {
+                    continue;
+                }
+                if (!chunk->loaded || !chunk->dirty) {
+                    continue;
+                }
+                if (!neighbors_loaded(chunk)) {
+                    continue;
+                }
             }
+            int invisible =
+                !chunk_visible(planes, a, b, 0, 256) &&
+                !(PREFETCH_CHUNKS && chunk_visible(predicted, a, b, 0, 256));
+            int priority = chunk && chunk->buffer;
+            Candidate *candidate = candidates + (*count)++;
+            candidate->score = (invisible << 24) | (priority << 16) | distance;
+            candidate->focus = focus;
+            candidate->a = a;
+            candidate->b = b;
+            candidate->chunk = chunk;
+        }
+    }
+    return candidates;
+}
+
+int candidate_compare_pq(const void *a, const void *b) {
+    Candidate *c1 = (Candidate *)a;
+    Candidate *c2 = (Candidate *)b;
+    return c1->a != c2->a ? c1->a - c2->a : c1->b - c2->b;
+}
+
+int candidate_compare_qp(const void *a, const void *b) {
+    Candidate *c1 = (Candidate *)a;
+    Candidate *c2 = (Candidate *)b;
+    return c1->b != c2->b ? c1->b - c2->b : c1->a - c2->a;
+}
+
+int band_length(Candidate *loads, int count, int i, int along_q) {
+    int n = 1;
+    for (; i + n < count; n++) {
+        Candidate *c1 = loads + i + n - 1;
+        Candidate *c2 = loads + i + n;
+        if (along_q && (c2->a != c1->a || c2->b != c1->b + 1)) {
+            break;
+        }
+        if (!along_q && (c2->b != c1->b || c2->a != c1->a + 1)) {
+            break;
         }
     }
-    if (best_score == start) {
-        return;
+    return n;
+}
+
+void submit_loads(Candidate *loads, int count) {
+    // neighboring chunks are loaded as bands with one range query each,
+    // going in whichever direction needs fewer of them
+    int (*compare[2])(const void *, const void *) = {
+        candidate_compare_pq, candidate_compare_qp
+    };
+    int bands[2] = {0, 0};
+    for (int axis = 0; axis < 2; axis++) {
+        qsort(loads, count, sizeof(Candidate), compare[axis]);
+        for (int i = 0; i < count; i += band_length(loads, count, i, !axis)) {
+            bands[axis]++;
+        }
     }
-    int a = best_a;
-    int b = best_b;
-    int load = 0;
-    Chunk *chunk = find_chunk(a, b);
-    if (!chunk) {
-        load = 1;
-        if (g->chunk_count < MAX_CHUNKS) {
-            chunk = g->chunks + g->chunk_count++;
-            init_chunk(chunk, a, b);
+    int axis = bands[1] < bands[0];
+    qsort(loads, count, sizeof(Candidate), compare[axis]);
+    for (int i = 0; i < count;) {
+        int n = band_length(loads, count, i, !axis);
+        if (n == 1) {
+            submit_load(loads[i].chunk, loads[i].score);
         }
         else {
-            return;
-        }
-    }
-    WorkerItem *item = &worker->item;
-    item->p = chunk->p;
-    item->q = chunk->q;
-    item->load = load;
-    for (int dp = -1; dp <= 1; dp++) {
-        for (int dq = -1; dq <= 1; dq++) {
-            Chunk *other = chunk;
-            if (dp || dq) {
-                other = find_chunk(chunk->p + dp, chunk->q + dq);
-            }
-            if (other) {
-                Map *block_map = malloc(sizeof(Map));
-                map_copy(block_map, &other->map);
-                Map *light_map = malloc(sizeof(Map));
-                map_copy(light_map, &other->lights);
-                item->block_maps[dp + 1][dq + 1] = block_map;
-                item->light_maps[dp + 1][dq + 1] = light_map;
-            }
-            else {
-                item->block_maps[dp + 1][dq + 1] = 0;
-                item->light_maps[dp + 1][dq + 1] = 0;
+            WorkerItem *band = (WorkerItem *)calloc(1, sizeof(WorkerItem));
+            band->p = loads[i].a;
+            band->q = loads[i].b;
+            band->priority = loads[i].score;
+            WorkerItem **link = &band->band;
+            for (int j = i; j < i + n; j++) {
+                WorkerItem *item = load_item(loads[j].chunk, loads[j].score);
+                band->priority = MIN(band->priority, item->priority);
+                *link = item;
+                link = &item->next;
             }
+            submit_item(band, STAGE_GENERATE);
         }
+        i += n;
     }
-    chunk->dirty = 0;
-    worker->state = WORKER_BUSY;
-    cnd_signal(&worker->cnd);
 }
 
-void ensure_chunks(Player *player) {
-    check_workers();
-    force_chunks(player);
-    for (int i = 0; i < WORKERS; i++) {
-        Worker *worker = g->workers + i;
-        mtx_lock(&worker->mtx);
-        if (worker->state == WORKER_IDLE) {
-            ensure_chunks_worker(player, worker);
+void ensure_chunks() {
+    Player *focuses[3];
+    int focus_count = 0;
+    int observed[3] = {g->observe1, g->observe2, 0};
+    for (int i = 0; i < 3; i++) {
+        int duplicate = 0;
+        for (int j = 0; j < i; j++) {
+            duplicate = duplicate || observed[i] == observed[j];
+        }
+        if (!duplicate) {
+            focuses[focus_count++] = g->players + observed[i];
+        }
+    }
+    Candidate *candidates = 0;
+    int count = 0;
+    for (int i = 0; i < focus_count; i++) {
+        force_chunks(focuses[i]);
+        candidates = add_candidates(candidates, &count, focuses[i], i);
+    }
+    qsort(candidates, count, sizeof(Candidate), candidate_compare);
+    // every focus is guaranteed its share of the free job slots, then
+    // whatever is left goes to the best candidates overall
+    int mesh_quota =
+        (MAX_MESH_JOBS - g->mesh_jobs + focus_count - 1) / focus_count;
+    int load_quota =
+        (MAX_LOAD_JOBS - g->load_jobs + focus_count - 1) / focus_count;
+    int meshes[3] = {0};
+    int loads[3] = {0};
+    Candidate batch[MAX_LOAD_JOBS];
+    int load_count = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < count; i++) {
+            Candidate *candidate = candidates + i;
+            Chunk *chunk = candidate->chunk;
+            int focus = candidate->focus;
+            if (chunk) {
+                if (chunk->busy || g->mesh_jobs >= MAX_MESH_JOBS) {
+                    continue;
+                }
+                if (!pass && meshes[focus] >= mesh_quota) {
+                    continue;
+                }
+                submit_mesh(chunk, candidate->score, 1);
+                meshes[focus]++;
+            }
+            else {
+                if (g->load_jobs + load_count >= MAX_LOAD_JOBS) {
+                    continue;
+                }
+                if (!pass && loads[focus] >= load_quota) {
+                    continue;
+                }
+                if (g->chunk_count >= MAX_CHUNKS) {
+                    continue;
+                }
+                // foci close to each other share candidates
+                if (find_chunk(candidate->a, candidate->b)) {
+                    continue;
+                }
+                // the candidate keeps no chunk, pass 1 must not mesh it
+                // before submit_loads has marked it busy
+                chunk = g->chunks + g->chunk_count++;
+                init_chunk(chunk, candidate->a, candidate->b);
+                batch[load_count] = *candidate;
+                batch[load_count++].chunk = chunk;
+                loads[focus]++;
+            }
         }
-        mtx_unlock(&worker->mtx);
     }
+    submit_loads(batch, load_count);
+    free(candidates);
 }
 
 int worker_run(void *arg) {
     Worker *worker = (Worker *)arg;
+    Stage *stage = g->stages + worker->stage;
     int running = 1;
     while (running) {
-        mtx_lock(&worker->mtx);
-        while (worker->state != WORKER_BUSY) {
-            cnd_wait(&worker->cnd, &worker->mtx);
-        }
-        mtx_unlock(&worker->mtx);
-        WorkerItem *item = &worker->item;
-        if (item->load) {
-            load_chunk(item);
+        WorkerItem *item = stage_get(stage);
+        switch (worker->stage) {
+            case STAGE_GENERATE:
+                // chunks coming from the cold cache are restored whole
+                if (item->band) {
+                    for (WorkerItem *e = item->band; e; e = e->next) {
+                        if (!e->cold) {
+                            generate_terrain(e);
+                        }
+                    }
+                }
+                else if (!item->cold) {
+                    generate_terrain(item);
+                }
+                submit_item(item, STAGE_LOAD);
+                break;
+            case STAGE_LOAD:
+                if (item->band) {
+                    load_band(item);
+                    WorkerItem *e = item->band;
+                    while (e) {
+                        // e->next is reused once the item is queued
+                        WorkerItem *next = e->next;
+                        e->stage = STAGE_LOAD;
+                        queue_push(&g->completed, &e->node);
+                        e = next;
+                    }
+                    free_item(item);
+                    break;
+                }
+                load_chunk(item);
+                queue_push(&g->completed, &item->node);
+                break;
+            case STAGE_LIGHT:
+                compute_volume(item);
+                compute_light(item);
+                submit_item(item, STAGE_MESH);
+                break;
+            case STAGE_MESH:
+                if (item->parent) {
+                    compute_slab(item);
+                    break;
+                }
+                if (!item->opaque) {
+                    compute_volume(item);
+                }
+                if (item->slab_count > 1) {
+                    split_slabs(item);
+                    for (int i = 1; i < item->slab_count; i++) {
+                        stage_put(stage, item->slabs + i);
+                    }
+                    compute_slab(item->slabs);
+                    break;
+                }
+                compute_mesh(item);
+                queue_push(&g->completed, &item->node);
+                break;
+            case STAGE_STORE:
+                pack_chunk(item);
+                queue_push(&g->completed, &item->node);
+                break;
         }
-        compute_chunk(item);
-        mtx_lock(&worker->mtx);
-        worker->state = WORKER_DONE;
-        mtx_unlock(&worker->mtx);
     }
     return 0;
 }
@@ -1452,6 +2313,7 @@ int worker_run(void *arg) {
 void unset_sign(int x, int y, int z) {
     int p = chunked(x);
     int q = chunked(z);
+    cold_cache_remove(&g->cold, p, q);
     Chunk *chunk = find_chunk(p, q);
     if (chunk) {
         SignList *signs = &chunk->signs;
@@ -1468,6 +2330,7 @@ void unset_sign(int x, int y, int z) {
 void unset_sign_face(int x, int y, int z, int face) {
     int p = chunked(x);
     int q = chunked(z);
+    cold_cache_remove(&g->cold, p, q);
     Chunk *chunk = find_chunk(p, q);
     if (chunk) {
         SignList *signs = &chunk->signs;
@@ -1488,6 +2351,7 @@ void _set_sign(
         unset_sign_face(x, y, z, face);
         return;
     }
+    cold_cache_remove(&g->cold, p, q);
     Chunk *chunk = find_chunk(p, q);
     if (chunk) {
         SignList *signs = &chunk->signs;
@@ -1511,16 +2375,19 @@ void toggle_light(int x, int y, int z) {
     int q = chunked(z);
     Chunk *chunk = find_chunk(p, q);
     if (chunk) {
+        invalidate_cold(p, q);
         Map *map = &chunk->lights;
         int w = map_get(map, x, y, z) ? 0 : 15;
         map_set(map, x, y, z, w);
         db_insert_light(p, q, x, y, z, w);
         client_light(x, y, z, w);
         dirty_chunk(chunk);
+        chunk->edited = 1;
     }
 }
 
 void set_light(int p, int q, int x, int y, int z, int w) {
+    invalidate_cold(p, q);
     Chunk *chunk = find_chunk(p, q);
     if (chunk) {
         Map *map = &chunk->lights;
@@ -1535,12 +2402,14 @@ void set_light(int p, int q, int x, int y, int z, int w) {
 }
 
 void _set_block(int p, int q, int x, int y, int z, int w, int dirty) {
+    invalidate_cold(p, q);
     Chunk *chunk = find_chunk(p, q);
     if (chunk) {
         Map *map = &chunk->map;
         if (map_set(map, x, y, z, w)) {
             if (dirty) {
                 dirty_chunk(chunk);
+                chunk->edited = 1;
             }
             db_insert_block(p, q, x, y, z, w);
         }
@@ -1554,6 +2423,80 @@ void _set_block(int p, int q, int x, int y, int z, int w, int dirty) {
     }
 }
 
+void ingest_batch(ChunkBatch *batch) {
+    int p = batch->p;
+    int q = batch->q;
+    Chunk *chunk = find_chunk(p, q);
+    State *s = &g->players->state;
+    int size = ring_size(&batch->lines);
+    int *blocks = (int *)malloc(sizeof(int) * 4 * size);
+    int *lights = (int *)malloc(sizeof(int) * 4 * size);
+    int block_count = 0;
+    int light_count = 0;
+    int changes = 0;
+    int dirty = batch->redraw;
+    int intersects = 0;
+    // an answer to a request without a key is stored whole, the chunk
+    // may have been evicted from the cache while it was loading
+    int full = batch->key == 0;
+    RingEntry e;
+    while (ring_get(&batch->lines, &e)) {
+        int w = e.w;
+        int owned = chunked(e.x) == p && chunked(e.z) == q;
+        if (e.type == BLOCK) {
+            int changed = !chunk || map_set(&chunk->map, e.x, e.y, e.z, w);
+            if (changed || full) {
+                int *a = blocks + block_count++ * 4;
+                a[0] = e.x; a[1] = e.y; a[2] = e.z; a[3] = w;
+            }
+            changes += changed;
+            if (w == 0 && owned) {
+                unset_sign(e.x, e.y, e.z);
+            }
+            if (player_intersects_block(2, s->x, s->y, s->z, e.x, e.y, e.z)) {
+                intersects = 1;
+            }
+            if (w != 0 || !owned) {
+                continue;
+            }
+        }
+        int changed = !chunk || map_set(&chunk->lights, e.x, e.y, e.z, w);
+        if (changed || full) {
+            int *a = lights + light_count++ * 4;
+            a[0] = e.x; a[1] = e.y; a[2] = e.z; a[3] = w;
+        }
+        changes += changed;
+        dirty |= changed;
+    }
+    if (changes) {
+        invalidate_cold(p, q);
+    }
+    if (batch->sign_key <= 0) {
+        // without a sign key the answer holds every sign of the chunk,
+        // cached signs it lacks were deleted while we were away
+        cold_cache_remove(&g->cold, p, q);
+        if (chunk && chunk->signs.size) {
+            chunk->signs.size = 0;
+            dirty = 1;
+        }
+        db_delete_chunk_signs(p, q);
+    }
+    for (int i = 0; i < batch->signs.size; i++) {
+        Sign *e = batch->signs.data + i;
+        _set_sign(p, q, e->x, e->y, e->z, e->face, e->text, 0);
+    }
+    db_insert_blocks(p, q, blocks, block_count);
+    db_insert_lights(p, q, lights, light_count);
+    free(blocks);
+    free(lights);
+    if (chunk && dirty) {
+        dirty_chunk(chunk);
+    }
+    if (intersects) {
+        s->y = highest_block(s->x, s->z) + 2;
+    }
+}
+
 void set_block(int x, int y, int z, int w) {
     int p = chunked(x);
     int q = chunked(z);
@@ -1598,18 +2541,41 @@ void builder_block(int x, int y, int z, int w) {
     if (y <= 0 || y >= 256) {
         return;
     }
-    if (is_destructable(get_block(x, y, z))) {
-        set_block(x, y, z, 0);
+    ring_put_block(&g->edits, chunked(x), chunked(z), x, y, z, w);
+}
+
+void apply_edits() {
+    RingEntry e;
+    double start = glfwGetTime();
+    while (!over_budget(start) && ring_get(&g->edits, &e)) {
+        if (is_destructable(get_block(e.x, e.y, e.z))) {
+            set_block(e.x, e.y, e.z, 0);
+        }
+        if (e.w) {
+            set_block(e.x, e.y, e.z, e.w);
+        }
     }
-    if (w) {
-        set_block(x, y, z, w);
+    spend_budget(start);
+}
+
+int count_visible_cells(float planes[6][4], int p, int q) {
+    int r = g->render_radius;
+    int result = 0;
+    for (int dp = -r; dp <= r; dp++) {
+        for (int dq = -r; dq <= r; dq++) {
+            if (chunk_visible(planes, p + dp, q + dq, 0, 256)) {
+                result++;
+            }
+        }
     }
+    return result;
 }
 
-int render_chunks(Attrib *attrib, Player *player) {
+int render_chunks(Attrib *attrib, Player *player, int *unready) {
+    // unready, if given, is set to the number of visible chunk cells
+    // that have nothing to draw yet
     int result = 0;
     State *s = &player->state;
-    ensure_chunks(player);
     int p = chunked(s->x);
     int q = chunked(s->z);
     float light = get_daylight();
@@ -1628,11 +2594,17 @@ int render_chunks(Attrib *attrib, Player *player) {
     glUniform1f(attrib->extra3, g->render_radius * CHUNK_SIZE);
     glUniform1i(attrib->extra4, g->ortho);
     glUniform1f(attrib->timer, time_of_day());
+    int ready = 0;
     for (int i = 0; i < g->chunk_count; i++) {
         Chunk *chunk = g->chunks + i;
         if (chunk_distance(chunk, p, q) > g->render_radius) {
             continue;
         }
+        if (unready && chunk->buffer &&
+            chunk_visible(planes, chunk->p, chunk->q, 0, 256))
+        {
+            ready++;
+        }
         if (!chunk_visible(
             planes, chunk->p, chunk->q, chunk->miny, chunk->maxy))
         {
@@ -1641,6 +2613,9 @@ int render_chunks(Attrib *attrib, Player *player) {
         draw_chunk(attrib, chunk);
         result += chunk->faces;
     }
+    if (unready) {
+        *unready = count_visible_cells(planes, p, q) - ready;
+    }
     return result;
 }
 
@@ -1809,10 +2784,16 @@ void add_message(const char *text) {
 }
 
 void login() {
+    // answered by check_login once the database worker gets to it
+    db_auth_login();
+}
+
+void check_login() {
     char username[128] = {0};
     char identity_token[128] = {0};
     char access_token[128] = {0};
-    if (db_auth_get_selected(username, 128, identity_token, 128)) {
+    int result = db_auth_result(username, 128, identity_token, 128);
+    if (result == DB_AUTH_SELECTED) {
         printf("Contacting login server for username: %s\n", username);
         if (get_access_token(
             access_token, 128, username, identity_token))
@@ -1825,10 +2806,13 @@ void login() {
             client_login("", "");
         }
     }
-    else {
+    else if (result == DB_AUTH_ANONYMOUS) {
         printf("Logging in anonymously\n");
         client_login("", "");
     }
+    else if (result == DB_AUTH_UNKNOWN) {
+        add_message("Unknown username.");
+    }
 }
 
 void copy() {
@@ -2018,6 +3002,202 @@ void tree(Block *block) {
     }
 }
 
+int float_compare(const void *a, const void *b) {
+    float x = *(const float *)a;
+    float y = *(const float *)b;
+    return (x > y) - (x < y);
+}
+
+void show_stats() {
+    char text[MAX_TEXT_LENGTH];
+    snprintf(text, MAX_TEXT_LENGTH,
+        "Unready: %.1f chunk-seconds in %.0f seconds",
+        g->unready, g->stats_time);
+    add_message(text);
+    int n = g->frame_count;
+    if (n) {
+        float times[FRAME_SAMPLES];
+        memcpy(times, g->frame_times, sizeof(float) * n);
+        qsort(times, n, sizeof(float), float_compare);
+        snprintf(text, MAX_TEXT_LENGTH,
+            "Frame: p50 %.1f ms, p95 %.1f ms, p99 %.1f ms",
+            times[n * 50 / 100] * 1000, times[n * 95 / 100] * 1000,
+            times[n * 99 / 100] * 1000);
+        add_message(text);
+    }
+    int writes, saved;
+    double seconds;
+    db_write_stats(&writes, &saved, &seconds);
+    if (writes || saved) {
+        snprintf(text, MAX_TEXT_LENGTH,
+            "Database: %d writes at %.0f writes/sec, %d coalesced",
+            writes, writes / MAX(seconds, 1e-6), saved);
+        add_message(text);
+    }
+    ColdCache *cold = &g->cold;
+    if (cold->hits || cold->misses) {
+        snprintf(text, MAX_TEXT_LENGTH,
+            "Cold cache: %d chunks in %d KB, %d hits, %d misses",
+            cold->size, (int)(cold->used / 1024), cold->hits, cold->misses);
+        add_message(text);
+        cold->hits = 0;
+        cold->misses = 0;
+    }
+    int received, chunk_bytes;
+    client_stats(&received, &chunk_bytes);
+    if (received) {
+        snprintf(text, MAX_TEXT_LENGTH,
+            "Network: protocol %d, %.1f KB/sec, %d chunks, %d bytes/chunk",
+            g->protocol, received / 1024.0 / MAX(g->stats_time, 1e-6),
+            g->stats_chunks, chunk_bytes / MAX(g->stats_chunks, 1));
+        add_message(text);
+    }
+    g->stats_chunks = 0;
+    g->unready = 0;
+    g->stats_time = 0;
+    g->frame_index = 0;
+    g->frame_count = 0;
+}
+
+void bench_db() {
+    State *s = &g->players->state;
+    int p = chunked(s->x);
+    int q = chunked(s->z);
+    int r = g->create_radius;
+    DbBenchmark b;
+    db_benchmark(p - r, q - r, p + r, q + r, &b);
+    char text[MAX_TEXT_LENGTH];
+    snprintf(text, MAX_TEXT_LENGTH,
+        "Bench: %d blocks in %d chunks", b.voxels, b.chunks);
+    add_message(text);
+    for (int i = 0; i < DB_BENCHMARK_STORAGES; i++) {
+        DbBenchmarkResult *result = b.results + i;
+        snprintf(text, MAX_TEXT_LENGTH,
+            "%s: write %.1f ms, cold load %.1f ms, %d edits %.1f ms, %d KB",
+            result->name, result->write * 1000, result->load * 1000,
+            b.edits, result->edit * 1000, result->size / 1024);
+        add_message(text);
+    }
+}
+
+void bench_parse() {
+    // a synthetic server stream, mostly chunk answers, parsed without
+    // applying it
+    int capacity = 8 << 20;
+    char *data = (char *)malloc(capacity + 256);
+    int size = 0;
+    int lines = 0;
+    unsigned int seed = 1;
+    while (size < capacity) {
+        seed = seed * 1103515245 + 12345;
+        int r = (seed >> 8) % 100;
+        int p = (int)(seed >> 16 & 0x1f) - 16;
+        int q = (int)(seed >> 11 & 0x1f) - 16;
+        int x = p * CHUNK_SIZE + (seed >> 3 & 0x1f);
+        int z = q * CHUNK_SIZE + (seed >> 21 & 0x1f);
+        int y = seed >> 24;
+        char *end = data + size;
+        if (r < 70) {
+            size += sprintf(end, "B,%d,%d,%d,%d,%d,%d\n",
+                p, q, x, y, z, r % 64);
+        }
+        else if (r < 80) {
+            size += sprintf(end, "L,%d,%d,%d,%d,%d,%d\n",
+                p, q, x, y, z, r % 16);
+        }
+        else if (r < 85) {
+            size += sprintf(end, "S,%d,%d,%d,%d,%d,%d,sign number %d\n",
+                p, q, x, y, z, r % 8, lines);
+        }
+        else if (r < 90) {
+            size += sprintf(end, "P,%d,%.2f,%.2f,%.2f,%.2f,%.2f\n",
+                r % 8, x + 0.25, y + 0.5, z - 0.75, r * 0.01, -r * 0.02);
+        }
+        else if (r < 94) {
+            size += sprintf(end, "K,%d,%d,%d,%d\n", p, q, lines, r);
+        }
+        else if (r < 97) {
+            size += sprintf(end, "R,%d,%d\n", p, q);
+        }
+        else {
+            size += sprintf(end, "C,%d,%d\n", p, q);
+        }
+        lines++;
+    }
+    double start = glfwGetTime();
+    int parsed = 0;
+    char *line = data;
+    char *stop = data + size;
+    while (line < stop) {
+        char *end = (char *)memchr(line, '\n', stop - line);
+        *end = '\0';
+        Message m;
+        parsed += message_parse(line, &m);
+        line = end + 1;
+    }
+    double elapsed = MAX(glfwGetTime() - start, 1e-6);
+    free(data);
+    char text[MAX_TEXT_LENGTH];
+    snprintf(text, MAX_TEXT_LENGTH,
+        "Bench: parsed %d of %d lines, %.1f MB in %.1f ms, %.0f MB/sec",
+        parsed, lines, size / 1048576.0, elapsed * 1000,
+        size / 1048576.0 / elapsed);
+    add_message(text);
+}
+
+void set_view_radius(int radius) {
+    g->create_radius = radius;
+    g->render_radius = radius;
+    g->delete_radius = radius + 4;
+}
+
+size_t chunk_memory() {
+    size_t result = 0;
+    for (int i = 0; i < g->chunk_count; i++) {
+        Chunk *chunk = g->chunks + i;
+        result += (chunk->map.mask + chunk->lights.mask + 2) *
+            sizeof(MapEntry);
+        result += chunk->faces * 6 * 10 * sizeof(GLfloat);
+    }
+    return result;
+}
+
+void update_view(double dt, double work) {
+    if (!g->auto_view) {
+        return;
+    }
+    g->view_time += dt;
+    g->view_work += work;
+    g->view_frames++;
+    g->view_backlog +=
+        g->load_jobs >= MAX_LOAD_JOBS || g->mesh_jobs >= MAX_MESH_JOBS;
+    if (g->view_time < VIEW_INTERVAL) {
+        return;
+    }
+    // work excludes the swap so that vsync does not count as load
+    double load = g->view_work / g->view_frames / VIEW_FRAME_TIME;
+    int backlog = g->view_backlog * 2 > g->view_frames;
+    size_t memory = chunk_memory();
+    int radius = g->render_radius;
+    if (g->view_hold) {
+        g->view_hold--;
+    }
+    else if (load > 0.9 || memory > VIEW_MEMORY) {
+        radius = MAX(radius - 1, 1);
+    }
+    else if (load < 0.5 && !backlog && memory < VIEW_MEMORY / 4 * 3) {
+        radius = MIN(radius + 1, 24);
+    }
+    if (radius != g->render_radius) {
+        set_view_radius(radius);
+        g->view_hold = VIEW_HOLD;
+    }
+    g->view_time = 0;
+    g->view_work = 0;
+    g->view_frames = 0;
+    g->view_backlog = 0;
+}
+
 void parse_command(const char *buffer, int forward) {
     char username[128] = {0};
     char token[128] = {0};
@@ -2035,12 +3215,8 @@ void parse_command(const char *buffer, int forward) {
         login();
     }
     else if (sscanf(buffer, "/login %128s", username) == 1) {
-        if (db_auth_select(username)) {
-            login();
-        }
-        else {
-            add_message("Unknown username.");
-        }
+        db_auth_select(username);
+        login();
     }
     else if (sscanf(buffer,
         "/online %128s %d", server_addr, &server_port) >= 1)
@@ -2062,16 +3238,28 @@ void parse_command(const char *buffer, int forward) {
         g->mode = MODE_OFFLINE;
         snprintf(g->db_path, MAX_PATH_LENGTH, "%s", DB_PATH);
     }
+    else if (strcmp(buffer, "/view auto") == 0) {
+        g->auto_view = 1;
+        g->view_hold = 0;
+    }
     else if (sscanf(buffer, "/view %d", &radius) == 1) {
         if (radius >= 1 && radius <= 24) {
-            g->create_radius = radius;
-            g->render_radius = radius;
-            g->delete_radius = radius + 4;
+            g->auto_view = 0;
+            set_view_radius(radius);
         }
         else {
             add_message("Viewing distance must be between 1 and 24.");
         }
     }
+    else if (strcmp(buffer, "/stats") == 0) {
+        show_stats();
+    }
+    else if (strcmp(buffer, "/bench db") == 0) {
+        bench_db();
+    }
+    else if (strcmp(buffer, "/bench parse") == 0) {
+        bench_parse();
+    }
     else if (strcmp(buffer, "/copy") == 0) {
         copy();
     }
@@ -2438,6 +3626,15 @@ void handle_movement(double dt) {
             }
         }
     }
+    Chunk *chunk = find_chunk(chunked(s->x), chunked(s->z));
+    if (!chunk || !chunk->loaded) {
+        // hold still until the ground under the player has loaded
+        return;
+    }
+    if (g->place_player) {
+        g->place_player = 0;
+        s->y = highest_block(s->x, s->z) + 2;
+    }
     float speed = g->flying ? 20 : 5;
     int estimate = roundf(sqrtf(
         powf(vx * speed, 2) +
@@ -2468,101 +3665,139 @@ void handle_movement(double dt) {
     }
 }
 
-void parse_buffer(char *buffer) {
+void parse_message(Message *m) {
     Player *me = g->players;
     State *s = &g->players->state;
-    char *key;
-    char *line = tokenize(buffer, "\n", &key);
-    while (line) {
-        int pid;
-        float ux, uy, uz, urx, ury;
-        if (sscanf(line, "U,%d,%f,%f,%f,%f,%f",
-            &pid, &ux, &uy, &uz, &urx, &ury) == 6)
-        {
-            me->id = pid;
-            s->x = ux; s->y = uy; s->z = uz; s->rx = urx; s->ry = ury;
+    int *a = m->ints;
+    float *f = m->floats;
+    int *v = m->voxels;
+    int p = a[0];
+    int q = a[1];
+    ChunkBatch *batch;
+    Player *player;
+    Chunk *chunk;
+    switch (m->type) {
+        case 'U':
+            me->id = a[0];
+            s->x = f[0]; s->y = f[1]; s->z = f[2]; s->rx = f[3]; s->ry = f[4];
             force_chunks(me);
-            if (uy == 0) {
-                s->y = highest_block(s->x, s->z) + 2;
+            if (f[1] == 0) {
+                g->place_player = 1;
             }
-        }
-        int bp, bq, bx, by, bz, bw;
-        if (sscanf(line, "B,%d,%d,%d,%d,%d,%d",
-            &bp, &bq, &bx, &by, &bz, &bw) == 6)
-        {
-            _set_block(bp, bq, bx, by, bz, bw, 0);
-            if (player_intersects_block(2, s->x, s->y, s->z, bx, by, bz)) {
-                s->y = highest_block(s->x, s->z) + 2;
+            break;
+        case 'B':
+            batch = find_batch(p, q);
+            for (int i = 0; i < m->count; i++, v += 4) {
+                if (batch) {
+                    ring_put_block(
+                        &batch->lines, p, q, v[0], v[1], v[2], v[3]);
+                    continue;
+                }
+                _set_block(p, q, v[0], v[1], v[2], v[3], 0);
+                if (player_intersects_block(
+                    2, s->x, s->y, s->z, v[0], v[1], v[2]))
+                {
+                    s->y = highest_block(s->x, s->z) + 2;
+                }
             }
-        }
-        if (sscanf(line, "L,%d,%d,%d,%d,%d,%d",
-            &bp, &bq, &bx, &by, &bz, &bw) == 6)
-        {
-            set_light(bp, bq, bx, by, bz, bw);
-        }
-        float px, py, pz, prx, pry;
-        if (sscanf(line, "P,%d,%f,%f,%f,%f,%f",
-            &pid, &px, &py, &pz, &prx, &pry) == 6)
-        {
-            Player *player = find_player(pid);
+            break;
+        case 'L':
+            batch = find_batch(p, q);
+            for (int i = 0; i < m->count; i++, v += 4) {
+                if (batch) {
+                    ring_put_light(
+                        &batch->lines, p, q, v[0], v[1], v[2], v[3]);
+                }
+                else {
+                    set_light(p, q, v[0], v[1], v[2], v[3]);
+                }
+            }
+            break;
+        case 'P':
+            player = find_player(a[0]);
             if (!player && g->player_count < MAX_PLAYERS) {
                 player = g->players + g->player_count;
                 g->player_count++;
-                player->id = pid;
+                player->id = a[0];
                 player->buffer = 0;
-                snprintf(player->name, MAX_NAME_LENGTH, "player%d", pid);
-                update_player(player, px, py, pz, prx, pry, 1); // twice
+                snprintf(player->name, MAX_NAME_LENGTH, "player%d", a[0]);
+                // twice
+                update_player(player, f[0], f[1], f[2], f[3], f[4], 1);
             }
             if (player) {
-                update_player(player, px, py, pz, prx, pry, 1);
+                update_player(player, f[0], f[1], f[2], f[3], f[4], 1);
             }
-        }
-        if (sscanf(line, "D,%d", &pid) == 1) {
-            delete_player(pid);
-        }
-        int kp, kq, kk;
-        if (sscanf(line, "K,%d,%d,%d", &kp, &kq, &kk) == 3) {
-            db_set_key(kp, kq, kk);
-        }
-        if (sscanf(line, "R,%d,%d", &kp, &kq) == 2) {
-            Chunk *chunk = find_chunk(kp, kq);
-            if (chunk) {
+            break;
+        case 'D':
+            delete_player(a[0]);
+            break;
+        case 'K':
+            if (m->int_count == 3) {
+                key_map_get(&g->keys, p, q, a + 3);
+            }
+            key_map_set(&g->keys, p, q, a[2], a[3], 1);
+            break;
+        case 'R':
+            chunk = find_chunk(p, q);
+            if ((batch = find_batch(p, q))) {
+                batch->redraw = 1;
+            }
+            else if (chunk) {
                 dirty_chunk(chunk);
             }
-        }
-        double elapsed;
-        int day_length;
-        if (sscanf(line, "E,%lf,%d", &elapsed, &day_length) == 2) {
-            glfwSetTime(fmod(elapsed, day_length));
-            g->day_length = day_length;
+            break;
+        case 'C':
+            g->stats_chunks++;
+            if ((batch = find_batch(p, q))) {
+                ingest_batch(batch);
+                close_batch(batch);
+            }
+            break;
+        case 'E':
+            g->day_time = fmod(m->number, a[0]);
+            g->day_length = a[0];
             g->time_changed = 1;
-        }
-        if (line[0] == 'T' && line[1] == ',') {
-            char *text = line + 2;
-            add_message(text);
-        }
-        char format[64];
-        snprintf(
-            format, sizeof(format), "N,%%d,%%%ds", MAX_NAME_LENGTH - 1);
-        char name[MAX_NAME_LENGTH];
-        if (sscanf(line, format, &pid, name) == 2) {
-            Player *player = find_player(pid);
+            break;
+        case 'T':
+            add_message(m->text);
+            break;
+        case 'N':
+            player = find_player(a[0]);
             if (player) {
-                strncpy(player->name, name, MAX_NAME_LENGTH);
+                strncpy(player->name, m->text, MAX_NAME_LENGTH - 1);
+                player->name[MAX_NAME_LENGTH - 1] = '\0';
             }
-        }
-        snprintf(
-            format, sizeof(format),
-            "S,%%d,%%d,%%d,%%d,%%d,%%d,%%%d[^\n]", MAX_SIGN_LENGTH - 1);
-        int face;
-        char text[MAX_SIGN_LENGTH] = {0};
-        if (sscanf(line, format,
-            &bp, &bq, &bx, &by, &bz, &face, text) >= 6)
-        {
-            _set_sign(bp, bq, bx, by, bz, face, text, 0);
-        }
-        line = tokenize(NULL, "\n", &key);
+            break;
+        case 'S':
+            if (strlen(m->text) >= MAX_SIGN_LENGTH) {
+                m->text[MAX_SIGN_LENGTH - 1] = '\0';
+            }
+            if ((batch = find_batch(p, q))) {
+                sign_list_add(&batch->signs, a[2], a[3], a[4], a[5], m->text);
+            }
+            else {
+                _set_sign(p, q, a[2], a[3], a[4], a[5], m->text, 0);
+            }
+            break;
+        case 'V':
+            // the server lists what it supports after its version
+            g->sign_keys = strstr(m->text, ",signs") != 0;
+            if (USE_BINARY_PROTOCOL && strstr(m->text, ",binary")) {
+                client_upgrade(
+                    USE_COMPRESSION && strstr(m->text, ",zlib") != 0);
+                g->protocol = 2;
+            }
+            break;
+    }
+}
+
+void parse_buffer() {
+    double start = glfwGetTime();
+    Message message;
+    while (!over_budget(start) && client_recv(&message)) {
+        parse_message(&message);
     }
+    spend_budget(start);
 }
 
 void reset_model() {
@@ -2579,8 +3814,10 @@ void reset_model() {
     memset(g->messages, 0, sizeof(char) * MAX_MESSAGES * MAX_TEXT_LENGTH);
     g->message_index = 0;
     g->day_length = DAY_LENGTH;
-    glfwSetTime(g->day_length / 3.0);
+    g->day_time = g->day_length / 3.0;
     g->time_changed = 1;
+    g->sign_keys = 0;
+    g->protocol = 1;
 }
 
 int main(int argc, char **argv) {
@@ -2699,6 +3936,15 @@ int main(int argc, char **argv) {
     sky_attrib.timer = glGetUniformLocation(program, "timer");
 
     // CHECK COMMAND LINE ARGUMENTS //
+    if (argc > 1 && strncmp(argv[1], "--storage=", 10) == 0) {
+        if (db_set_storage(argv[1] + 10)) {
+            printf("Unknown storage: %s\n", argv[1] + 10);
+            glfwTerminate();
+            return -1;
+        }
+        argc--;
+        argv++;
+    }
     if (argc == 2 || argc == 3) {
         g->mode = MODE_ONLINE;
         strncpy(g->server_addr, argv[1], MAX_ADDR_LENGTH);
@@ -2717,13 +3963,27 @@ int main(int argc, char **argv) {
     g->sign_radius = RENDER_SIGN_RADIUS;
 
     // INITIALIZE WORKER THREADS
-    for (int i = 0; i < WORKERS; i++) {
-        Worker *worker = g->workers + i;
-        worker->index = i;
-        worker->state = WORKER_IDLE;
-        mtx_init(&worker->mtx, mtx_plain);
-        cnd_init(&worker->cnd);
-        thrd_create(&worker->thrd, worker_run, worker);
+    static const int stage_workers[STAGES] = {
+        GENERATE_WORKERS, LOAD_WORKERS, LIGHT_WORKERS, MESH_WORKERS,
+        STORE_WORKERS
+    };
+    queue_init(&g->completed);
+    ring_alloc(&g->edits, 1024);
+    key_map_alloc(&g->keys, 0xfff);
+    cold_cache_alloc(&g->cold, COLD_CACHE_SIZE);
+    for (int i = 0; i < STAGES; i++) {
+        Stage *stage = g->stages + i;
+        stage->head = 0;
+        mtx_init(&stage->mtx, mtx_plain);
+        cnd_init(&stage->cnd);
+    }
+    for (int i = 0, index = 0; i < STAGES; i++) {
+        for (int j = 0; j < stage_workers[i]; j++) {
+            Worker *worker = g->workers + index;
+            worker->index = index++;
+            worker->stage = i;
+            thrd_create(&worker->thrd, worker_run, worker);
+        }
     }
 
     // OUTER LOOP //
@@ -2732,14 +3992,14 @@ int main(int argc, char **argv) {
         // DATABASE INITIALIZATION //
         if (g->mode == MODE_OFFLINE || USE_CACHE) {
             db_enable();
+            db_set_cache_size(
+                g->mode == MODE_ONLINE ? ONLINE_CACHE_SIZE : 0);
             if (db_init(g->db_path)) {
                 return -1;
             }
-            if (g->mode == MODE_ONLINE) {
-                // TODO: support proper caching of signs (handle deletions)
-                db_delete_all_signs();
-            }
         }
+        key_map_clear(&g->keys);
+        db_load_keys(load_key, &g->keys);
 
         // CLIENT INITIALIZATION //
         if (g->mode == MODE_ONLINE) {
@@ -2767,9 +4027,7 @@ int main(int argc, char **argv) {
         // LOAD STATE FROM DATABASE //
         int loaded = db_load_state(&s->x, &s->y, &s->z, &s->rx, &s->ry);
         force_chunks(me);
-        if (!loaded) {
-            s->y = highest_block(s->x, s->z) + 2;
-        }
+        g->place_player = !loaded;
 
         // BEGIN MAIN LOOP //
         double previous = glfwGetTime();
@@ -2781,6 +4039,11 @@ int main(int argc, char **argv) {
 
             // FRAME RATE //
             if (g->time_changed) {
+                // the clock only jumps between frames, so that no frame
+                // time or work budget is measured across the jump
+                double elapsed = glfwGetTime() - previous;
+                glfwSetTime(g->day_time);
+                previous = g->day_time - elapsed;
                 g->time_changed = 0;
                 last_commit = glfwGetTime();
                 last_update = glfwGetTime();
@@ -2788,10 +4051,11 @@ int main(int argc, char **argv) {
             }
             update_fps(&fps);
             double now = glfwGetTime();
-            double dt = now - previous;
-            dt = MIN(dt, 0.2);
-            dt = MAX(dt, 0.0);
+            // stalls are clamped for the simulation, not for the stats
+            double frame_time = MAX(now - previous, 0.0);
+            double dt = MIN(frame_time, 0.2);
             previous = now;
+            g->budget = FRAME_BUDGET;
 
             // HANDLE MOUSE INPUT //
             handle_mouse_input();
@@ -2800,15 +4064,12 @@ int main(int argc, char **argv) {
             handle_movement(dt);
 
             // HANDLE DATA FROM SERVER //
-            char *buffer = client_recv();
-            if (buffer) {
-                parse_buffer(buffer);
-                free(buffer);
-            }
+            parse_buffer();
 
             // FLUSH DATABASE //
             if (now - last_commit > COMMIT_INTERVAL) {
                 last_commit = now;
+                flush_keys();
                 db_commit();
             }
 
@@ -2827,14 +4088,34 @@ int main(int argc, char **argv) {
             for (int i = 1; i < g->player_count; i++) {
                 interpolate_player(g->players + i);
             }
+            for (int i = 0; i < g->player_count; i++) {
+                update_motion(g->players + i, dt);
+            }
             Player *player = g->players + g->observe1;
 
+            // DEFERRED WORK //
+            db_evictions(evict_chunk, 0);
+            check_workers(player);
+            check_login();
+            ensure_chunks();
+            apply_edits();
+            free_deleted_chunks();
+            db_flush();
+
+            // STREAMING STATS //
+            g->stats_time += frame_time;
+            g->frame_times[g->frame_index] = frame_time;
+            g->frame_index = (g->frame_index + 1) % FRAME_SAMPLES;
+            g->frame_count = MIN(g->frame_count + 1, FRAME_SAMPLES);
+
             // RENDER 3-D SCENE //
             glClear(GL_COLOR_BUFFER_BIT);
             glClear(GL_DEPTH_BUFFER_BIT);
             render_sky(&sky_attrib, player, sky_buffer);
             glClear(GL_DEPTH_BUFFER_BIT);
-            int face_count = render_chunks(&block_attrib, player);
+            int unready;
+            int face_count = render_chunks(&block_attrib, player, &unready);
+            g->unready += unready * frame_time;
             render_signs(&text_attrib, player);
             render_sign(&text_attrib, player);
             render_players(&block_attrib, player);
@@ -2863,10 +4144,12 @@ int main(int argc, char **argv) {
                 hour = hour ? hour : 12;
                 snprintf(
                     text_buffer, 1024,
-                    "(%d, %d) (%.2f, %.2f, %.2f) [%d, %d, %d] %d%cm %dfps",
+                    "(%d, %d) (%.2f, %.2f, %.2f) [%d, %d, %d] %d%cm %dfps "
+                    "r%d%s",
                     chunked(s->x), chunked(s->z), s->x, s->y, s->z,
                     g->player_count, g->chunk_count,
-                    face_count * 2, hour, am_pm, fps.fps);
+                    face_count * 2, hour, am_pm, fps.fps,
+                    g->render_radius, g->auto_view ? " auto" : "");
                 render_text(&text_attrib, ALIGN_LEFT, tx, ty, ts, text_buffer);
                 ty -= ts * 2;
             }
@@ -2923,7 +4206,7 @@ int main(int argc, char **argv) {
 
                 render_sky(&sky_attrib, player, sky_buffer);
                 glClear(GL_DEPTH_BUFFER_BIT);
-                render_chunks(&block_attrib, player);
+                render_chunks(&block_attrib, player, 0);
                 render_signs(&text_attrib, player);
                 render_players(&block_attrib, player);
                 glClear(GL_DEPTH_BUFFER_BIT);
@@ -2933,6 +4216,9 @@ int main(int argc, char **argv) {
                 }
             }
 
+            // ADJUST VIEW DISTANCE //
+            update_view(dt, glfwGetTime() - now);
+
             // SWAP AND POLL //
             glfwSwapBuffers(g->window);
             glfwPollEvents();
@@ -2947,6 +4233,13 @@ int main(int argc, char **argv) {
         }
 
         // SHUTDOWN //
+        while (!ring_empty(&g->edits)) {
+            apply_edits();
+        }
+        drain_workers();
+        cold_cache_clear(&g->cold);
+        free_batches();
+        flush_keys();
         db_save_state(s->x, s->y, s->z, s->rx, s->ry);
         db_close();
         db_disable();
@@ -35,6 +35,7 @@ typedef struct {
     MapEntry *data;
 } Map;
 
+int hash(int x, int y, int z);
 void map_alloc(Map *map, int dx, int dy, int dz, int mask);
 void map_free(Map *map);
 void map_copy(Map *dst, Map *src);
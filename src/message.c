@@ -0,0 +1,298 @@
+#include <stddef.h>
+#include <string.h>
+#include "config.h"
+#include "message.h"
+
+// Hand written scanners for the comma separated fields of server lines,
+// each returns the position after the field and its separator, or null
+// when the field is malformed.
+
+static char *scan_separator(char *s) {
+    if (*s == ',') {
+        return s + 1;
+    }
+    return *s == '\0' ? s : 0;
+}
+
+static char *scan_int(char *s, int *value) {
+    int negative = *s == '-';
+    if (*s == '-' || *s == '+') {
+        s++;
+    }
+    if (*s < '0' || *s > '9') {
+        return 0;
+    }
+    unsigned int result = 0;
+    while (*s >= '0' && *s <= '9') {
+        result = result * 10 + (*s++ - '0');
+    }
+    *value = negative ? -(int)result : (int)result;
+    return scan_separator(s);
+}
+
+static char *scan_double(char *s, double *value) {
+    static const double powers[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+        1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18
+    };
+    int negative = *s == '-';
+    if (*s == '-' || *s == '+') {
+        s++;
+    }
+    double result = 0;
+    int digits = 0;
+    while (*s >= '0' && *s <= '9') {
+        result = result * 10 + (*s++ - '0');
+        digits++;
+    }
+    if (*s == '.') {
+        s++;
+        double fraction = 0;
+        int places = 0;
+        while (*s >= '0' && *s <= '9') {
+            if (places < 18) {
+                fraction = fraction * 10 + (*s - '0');
+                places++;
+            }
+            s++;
+            digits++;
+        }
+        result += fraction / powers[places];
+    }
+    if (!digits) {
+        return 0;
+    }
+    if (*s == 'e' || *s == 'E') {
+        int exponent;
+        char *end = scan_int(s + 1, &exponent);
+        if (!end) {
+            return 0;
+        }
+        int n = exponent < 0 ? -exponent : exponent;
+        for (; n > 0; n -= 18) {
+            double power = powers[n < 18 ? n : 18];
+            result = exponent < 0 ? result / power : result * power;
+        }
+        *value = negative ? -result : result;
+        return end;
+    }
+    *value = negative ? -result : result;
+    return scan_separator(s);
+}
+
+static char *scan_ints(char *s, Message *message, int count) {
+    // reads up to count integers, stopping at the end of the line
+    while (s && *s && message->int_count < count) {
+        s = scan_int(s, message->ints + message->int_count);
+        if (s) {
+            message->int_count++;
+        }
+    }
+    return s;
+}
+
+static char *scan_floats(char *s, Message *message, int count) {
+    for (int i = 0; s && i < count; i++) {
+        double value;
+        s = scan_double(s, &value);
+        message->floats[i] = value;
+    }
+    return s;
+}
+
+static int scan_player(char *s, Message *message) {
+    // pid followed by a position and rotation
+    s = scan_ints(s, message, 1);
+    return message->int_count == 1 && scan_floats(s, message, 5);
+}
+
+int message_parse(char *line, Message *message) {
+    // returns 0 for lines that are unknown or malformed
+    if (line[0] == '\0' || line[1] != ',') {
+        return 0;
+    }
+    char *s = line + 2;
+    message->type = line[0];
+    message->int_count = 0;
+    message->text = 0;
+    message->count = 0;
+    message->voxels = 0;
+    switch (line[0]) {
+        case 'U':
+        case 'P':
+            return scan_player(s, message);
+        case 'B':
+        case 'L':
+            scan_ints(s, message, 6);
+            message->count = 1;
+            message->voxels = message->ints + 2;
+            return message->int_count == 6;
+        case 'K':
+            scan_ints(s, message, 4);
+            return message->int_count >= 3;
+        case 'R':
+        case 'C':
+            scan_ints(s, message, 2);
+            return message->int_count == 2;
+        case 'D':
+            scan_ints(s, message, 1);
+            return message->int_count == 1;
+        case 'E':
+            s = scan_double(s, &message->number);
+            scan_ints(s, message, 1);
+            return s && message->int_count == 1;
+        case 'N':
+            s = scan_ints(s, message, 1);
+            message->text = s;
+            return message->int_count == 1 && s && *s;
+        case 'S':
+            // the text may be empty and may contain commas
+            s = scan_ints(s, message, 6);
+            message->text = s;
+            return message->int_count == 6 && s;
+        case 'T':
+        case 'V':
+            message->text = s;
+            return 1;
+    }
+    return 0;
+}
+
+// Binary frames of protocol version 2 start with a kind byte, either 0 for
+// a text line or a command character, followed by varints. Signed values
+// are zigzag encoded and floats are little endian. The readers return the
+// position after the field, or null when it runs past the end.
+
+static unsigned char *get_varint(
+    unsigned char *data, unsigned char *end, unsigned int *value)
+{
+    unsigned int result = 0;
+    for (int shift = 0; data && data < end && shift < 35; shift += 7) {
+        unsigned char byte = *data++;
+        result |= (unsigned int)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return data;
+        }
+    }
+    return 0;
+}
+
+static unsigned char *get_zigzag(
+    unsigned char *data, unsigned char *end, int *value)
+{
+    unsigned int result;
+    data = get_varint(data, end, &result);
+    if (data) {
+        *value = (int)(result >> 1) ^ -(int)(result & 1);
+    }
+    return data;
+}
+
+static unsigned char *get_float(
+    unsigned char *data, unsigned char *end, float *value)
+{
+    if (!data || end - data < 4) {
+        return 0;
+    }
+    unsigned int bits = data[0] | data[1] << 8 | data[2] << 16 |
+        (unsigned int)data[3] << 24;
+    memcpy(value, &bits, sizeof(float));
+    return data + 4;
+}
+
+static unsigned char *get_ints(
+    unsigned char *data, unsigned char *end, Message *message, int count)
+{
+    while (data && data < end && message->int_count < count) {
+        data = get_zigzag(data, end, message->ints + message->int_count);
+        if (data) {
+            message->int_count++;
+        }
+    }
+    return data;
+}
+
+static int get_player(
+    unsigned char *data, unsigned char *end, Message *message)
+{
+    // the player id is a plain varint
+    unsigned int pid;
+    data = get_varint(data, end, &pid);
+    if (data) {
+        message->ints[message->int_count++] = (int)pid;
+    }
+    for (int i = 0; i < MAX_MESSAGE_FLOATS; i++) {
+        data = get_float(data, end, message->floats + i);
+    }
+    return message->int_count == 1 && data == end;
+}
+
+static int get_voxels(
+    unsigned char *data, unsigned char *end, Message *message, int *voxels)
+{
+    // chunk relative positions, made absolute here
+    unsigned int count;
+    data = get_ints(data, end, message, 2);
+    data = get_varint(data, end, &count);
+    if (message->int_count != 2 || !data || count > MAX_MESSAGE_VOXELS) {
+        return 0;
+    }
+    int dx = message->ints[0] * CHUNK_SIZE;
+    int dz = message->ints[1] * CHUNK_SIZE;
+    for (unsigned int i = 0; i < count; i++) {
+        int *voxel = voxels + i * 4;
+        for (int j = 0; j < 4; j++) {
+            data = get_zigzag(data, end, voxel + j);
+        }
+        if (!data) {
+            return 0;
+        }
+        voxel[0] += dx;
+        voxel[2] += dz;
+    }
+    message->count = count;
+    message->voxels = voxels;
+    return data == end;
+}
+
+int message_decode(
+    unsigned char *data, int size, Message *message, int *voxels)
+{
+    // voxels has room for MAX_MESSAGE_VOXELS blocks, the frame itself may
+    // be modified, returns 0 for frames that are unknown or malformed
+    if (size < 2) {
+        return 0;
+    }
+    if (data[0] == 0) {
+        // a text line, newline included
+        data[size - 1] = '\0';
+        return message_parse((char *)data + 1, message);
+    }
+    unsigned char *end = data + size;
+    message->type = data[0];
+    message->int_count = 0;
+    message->text = 0;
+    message->count = 0;
+    message->voxels = 0;
+    data++;
+    switch (message->type) {
+        case 'U':
+        case 'P':
+            return get_player(data, end, message);
+        case 'B':
+        case 'L':
+            return get_voxels(data, end, message, voxels);
+        case 'K':
+            data = get_ints(data, end, message, 4);
+            return message->int_count >= 3 && data == end;
+        case 'R':
+        case 'C':
+            data = get_ints(data, end, message, 2);
+            return message->int_count == 2 && data == end;
+        case 'D':
+            data = get_ints(data, end, message, 1);
+            return message->int_count == 1 && data == end;
+    }
+    return 0;
+}
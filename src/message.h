@@ -0,0 +1,27 @@
+#ifndef _message_h_
+#define _message_h_
+
+#define MAX_MESSAGE_INTS 6
+#define MAX_MESSAGE_FLOATS 5
+#define MAX_MESSAGE_VOXELS 4096
+
+// One line or frame from the server, split into its fields. Which fields
+// are set depends on the type, the command character that starts the line.
+// Blocks and lights come as count x, y, z, w quadruples in voxels, one
+// for a line and up to MAX_MESSAGE_VOXELS for a frame, after p and q.
+typedef struct {
+    char type;
+    int int_count;
+    int ints[MAX_MESSAGE_INTS];
+    float floats[MAX_MESSAGE_FLOATS];
+    double number;
+    char *text;
+    int count;
+    int *voxels;
+} Message;
+
+int message_parse(char *line, Message *message);
+int message_decode(
+    unsigned char *data, int size, Message *message, int *voxels);
+
+#endif
@@ -0,0 +1,50 @@
+#include <stddef.h>
+#include "atomic.h"
+#include "queue.h"
+
+void queue_init(Queue *queue) {
+    queue->stub.next = NULL;
+    queue->head = &queue->stub;
+    queue->tail = &queue->stub;
+}
+
+int queue_empty(Queue *queue) {
+    QueueNode *tail = queue->tail;
+    return tail == &queue->stub && !ATOMIC_LOAD(&tail->next);
+}
+
+// safe to call from any thread
+void queue_push(Queue *queue, QueueNode *node) {
+    ATOMIC_STORE(&node->next, NULL);
+    QueueNode *prev = ATOMIC_EXCHANGE(&queue->head, node);
+    ATOMIC_STORE(&prev->next, node);
+}
+
+// consumer thread only, returns nodes in the order they were pushed
+QueueNode *queue_pop(Queue *queue) {
+    QueueNode *tail = queue->tail;
+    QueueNode *next = ATOMIC_LOAD(&tail->next);
+    if (tail == &queue->stub) {
+        if (!next) {
+            return NULL;
+        }
+        queue->tail = next;
+        tail = next;
+        next = ATOMIC_LOAD(&next->next);
+    }
+    if (next) {
+        queue->tail = next;
+        return tail;
+    }
+    if (tail != ATOMIC_LOAD(&queue->head)) {
+        // a producer is between the exchange and the link, try next time
+        return NULL;
+    }
+    queue_push(queue, &queue->stub);
+    next = ATOMIC_LOAD(&tail->next);
+    if (next) {
+        queue->tail = next;
+        return tail;
+    }
+    return NULL;
+}
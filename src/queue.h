@@ -0,0 +1,22 @@
+#ifndef _queue_h_
+#define _queue_h_
+
+// intrusive multi-producer / single-consumer queue, embed a QueueNode
+// as the first member of the struct to be queued
+
+typedef struct QueueNode {
+    struct QueueNode *next;
+} QueueNode;
+
+typedef struct {
+    QueueNode *head;
+    QueueNode *tail;
+    QueueNode stub;
+} Queue;
+
+void queue_init(Queue *queue);
+int queue_empty(Queue *queue);
+void queue_push(Queue *queue, QueueNode *node);
+QueueNode *queue_pop(Queue *queue);
+
+#endif
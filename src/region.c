@@ -0,0 +1,417 @@
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "region.h"
+
+// A region file holds the block and light blobs of 32x32 chunks. A header
+// with an (offset, size) table for every chunk and layer is followed by
+// blobs in the order they were written. Rewriting a chunk appends its new
+// blob and leaves the old one behind until the file is compacted.
+
+#define REGION_MAGIC "CRGN"
+#define REGION_VERSION 1
+#define REGION_CHUNKS (REGION_SIZE * REGION_SIZE)
+#define REGION_GROW (64 << 10)
+
+typedef struct {
+    char magic[4];
+    unsigned int version;
+    unsigned int end;
+    unsigned int live;
+    unsigned int table[REGION_LAYERS][REGION_CHUNKS][2];
+} RegionHeader;
+
+#ifndef _WIN32
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static int region_of(int p) {
+    return p >= 0 ? p / REGION_SIZE : (p + 1) / REGION_SIZE - 1;
+}
+
+static int region_index(int p, int q) {
+    int a = p - region_of(p) * REGION_SIZE;
+    int b = q - region_of(q) * REGION_SIZE;
+    return b * REGION_SIZE + a;
+}
+
+static void region_file(RegionStore *store, int x, int z, char *path) {
+    snprintf(path, 512, "%s/r.%d.%d.region", store->path, x, z);
+}
+
+static int region_map(Region *region, unsigned int capacity) {
+    if (region->data) {
+        munmap(region->data, region->capacity);
+        region->data = 0;
+    }
+    if (ftruncate(region->fd, capacity)) {
+        return -1;
+    }
+    void *data = mmap(0, capacity, PROT_READ | PROT_WRITE, MAP_SHARED,
+        region->fd, 0);
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+    region->data = (unsigned char *)data;
+    region->capacity = capacity;
+    return 0;
+}
+
+static void region_unmap(Region *region) {
+    if (region->data) {
+        munmap(region->data, region->capacity);
+        region->data = 0;
+    }
+    if (region->fd >= 0) {
+        close(region->fd);
+        region->fd = -1;
+    }
+}
+
+static int region_attach(RegionStore *store, Region *region, int create) {
+    char path[512];
+    region_file(store, region->x, region->z, path);
+    region->fd = open(path, O_RDWR | (create ? O_CREAT : 0), 0644);
+    if (region->fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    fstat(region->fd, &st);
+    if (st.st_size < (off_t)sizeof(RegionHeader)) {
+        if (region_map(region, sizeof(RegionHeader) + REGION_GROW)) {
+            region_unmap(region);
+            return -1;
+        }
+        RegionHeader *header = (RegionHeader *)region->data;
+        memset(header, 0, sizeof(RegionHeader));
+        memcpy(header->magic, REGION_MAGIC, 4);
+        header->version = REGION_VERSION;
+        header->end = sizeof(RegionHeader);
+        return 0;
+    }
+    if (region_map(region, st.st_size)) {
+        region_unmap(region);
+        return -1;
+    }
+    RegionHeader *header = (RegionHeader *)region->data;
+    if (memcmp(header->magic, REGION_MAGIC, 4) ||
+        header->version != REGION_VERSION || header->end > st.st_size)
+    {
+        printf("Ignoring unreadable region file: %s\n", path);
+        region_unmap(region);
+        return -1;
+    }
+    return 0;
+}
+
+static Region *region_get(RegionStore *store, int p, int q, int create) {
+    // regions that have no file yet are remembered with fd = -1
+    int x = region_of(p);
+    int z = region_of(q);
+    Region *region = 0;
+    mtx_lock(&store->mtx);
+    for (int i = 0; i < store->count; i++) {
+        Region *other = store->regions[i];
+        if (other->x == x && other->z == z) {
+            region = other;
+            break;
+        }
+    }
+    if (!region) {
+        if (store->count == store->capacity) {
+            store->capacity = store->capacity ? store->capacity * 2 : 16;
+            store->regions = (Region **)realloc(
+                store->regions, sizeof(Region *) * store->capacity);
+        }
+        region = (Region *)calloc(1, sizeof(Region));
+        region->x = x;
+        region->z = z;
+        region->fd = -1;
+        mtx_init(&region->mtx, mtx_plain);
+        region_attach(store, region, create);
+        store->regions[store->count++] = region;
+    }
+    else if (create && !region->data) {
+        mtx_lock(&region->mtx);
+        region_attach(store, region, create);
+        mtx_unlock(&region->mtx);
+    }
+    mtx_unlock(&store->mtx);
+    return region;
+}
+
+static void region_compact(RegionStore *store, Region *region) {
+    // live blobs are copied to a new file that replaces the old one
+    char path[512];
+    char temp[520];
+    region_file(store, region->x, region->z, path);
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+    RegionHeader *header = (RegionHeader *)region->data;
+    unsigned int capacity = sizeof(RegionHeader) + header->live + REGION_GROW;
+    unsigned char *data = (unsigned char *)calloc(1, capacity);
+    RegionHeader *compact = (RegionHeader *)data;
+    memcpy(compact->magic, header->magic, 4);
+    compact->version = header->version;
+    compact->live = header->live;
+    unsigned int end = sizeof(RegionHeader);
+    for (int layer = 0; layer < REGION_LAYERS; layer++) {
+        for (int i = 0; i < REGION_CHUNKS; i++) {
+            unsigned int *entry = header->table[layer][i];
+            if (!entry[1]) {
+                continue;
+            }
+            memcpy(data + end, region->data + entry[0], entry[1]);
+            compact->table[layer][i][0] = end;
+            compact->table[layer][i][1] = entry[1];
+            end += entry[1];
+        }
+    }
+    compact->end = end;
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int ok = fd >= 0 && write(fd, data, capacity) == (ssize_t)capacity &&
+        fsync(fd) == 0;
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(data);
+    if (!ok || rename(temp, path)) {
+        remove(temp);
+        return;
+    }
+    region_unmap(region);
+    region_attach(store, region, 0);
+}
+
+int region_store_open(RegionStore *store, const char *path) {
+    snprintf(store->path, sizeof(store->path), "%s", path);
+    mkdir(path, 0755);
+    struct stat st;
+    if (stat(path, &st) || !S_ISDIR(st.st_mode)) {
+        return -1;
+    }
+    mtx_init(&store->mtx, mtx_plain);
+    store->regions = 0;
+    store->count = 0;
+    store->capacity = 0;
+    // existing files are mapped up front so that sizes cover all of them
+    DIR *dir = opendir(path);
+    struct dirent *entry;
+    while (dir && (entry = readdir(dir))) {
+        int x, z;
+        if (sscanf(entry->d_name, "r.%d.%d.region", &x, &z) == 2) {
+            region_get(store, x * REGION_SIZE, z * REGION_SIZE, 0);
+        }
+    }
+    if (dir) {
+        closedir(dir);
+    }
+    return 0;
+}
+
+void region_store_close(RegionStore *store) {
+    for (int i = 0; i < store->count; i++) {
+        Region *region = store->regions[i];
+        if (region->data) {
+            RegionHeader *header = (RegionHeader *)region->data;
+            msync(region->data, header->end, MS_SYNC);
+        }
+        region_unmap(region);
+        mtx_destroy(&region->mtx);
+        free(region);
+    }
+    free(store->regions);
+    mtx_destroy(&store->mtx);
+}
+
+void region_store_remove(const char *path) {
+    // deletes the region files of a closed store and then its directory
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        if (strncmp(entry->d_name, "r.", 2) == 0) {
+            char file[512];
+            snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+            remove(file);
+        }
+    }
+    closedir(dir);
+    rmdir(path);
+}
+
+int region_store_save(
+    RegionStore *store, int layer, int p, int q, Voxel *voxels, int count)
+{
+    // voxels are sorted by key and replace the stored ones with equal keys,
+    // returns -1 and stores nothing when the region cannot be written
+    Region *region = region_get(store, p, q, 1);
+    mtx_lock(&region->mtx);
+    if (!region->data) {
+        mtx_unlock(&region->mtx);
+        return -1;
+    }
+    RegionHeader *header = (RegionHeader *)region->data;
+    unsigned int *entry = header->table[layer][region_index(p, q)];
+    Voxel *stored = 0;
+    int stored_count = 0;
+    if (entry[1]) {
+        stored = blob_decode(
+            region->data + entry[0], entry[1], &stored_count);
+    }
+    int merged_count;
+    Voxel *merged = blob_merge(
+        stored, stored_count, voxels, count, &merged_count);
+    int size;
+    unsigned char *data = blob_encode(merged, merged_count, &size);
+    if (header->end + size > region->capacity) {
+        unsigned int capacity = region->capacity * 2;
+        while (header->end + size > capacity) {
+            capacity *= 2;
+        }
+        if (region_map(region, capacity)) {
+            // the old size is mapped again, or the file is closed so that
+            // the next save attaches it afresh
+            fprintf(stderr, "Unable to grow region file %d, %d\n",
+                region->x, region->z);
+            if (region_map(region, region->capacity)) {
+                region_unmap(region);
+            }
+            mtx_unlock(&region->mtx);
+            free(stored);
+            free(merged);
+            free(data);
+            return -1;
+        }
+        header = (RegionHeader *)region->data;
+        entry = header->table[layer][region_index(p, q)];
+    }
+    memcpy(region->data + header->end, data, size);
+    header->live += size - entry[1];
+    entry[0] = header->end;
+    entry[1] = size;
+    header->end += size;
+    mtx_unlock(&region->mtx);
+    free(stored);
+    free(merged);
+    free(data);
+    return 0;
+}
+
+Voxel *region_store_load(
+    RegionStore *store, int layer, int p, int q, int *count)
+{
+    Region *region = region_get(store, p, q, 0);
+    Voxel *result = 0;
+    *count = 0;
+    mtx_lock(&region->mtx);
+    if (region->data) {
+        RegionHeader *header = (RegionHeader *)region->data;
+        unsigned int *entry = header->table[layer][region_index(p, q)];
+        if (entry[1]) {
+            result = blob_decode(region->data + entry[0], entry[1], count);
+        }
+    }
+    mtx_unlock(&region->mtx);
+    return result;
+}
+
+void region_store_clear(RegionStore *store, int p, int q) {
+    // forgets both layers of a chunk, compaction reclaims the space
+    Region *region = region_get(store, p, q, 0);
+    mtx_lock(&region->mtx);
+    if (region->data) {
+        RegionHeader *header = (RegionHeader *)region->data;
+        for (int layer = 0; layer < REGION_LAYERS; layer++) {
+            unsigned int *entry = header->table[layer][region_index(p, q)];
+            header->live -= entry[1];
+            entry[0] = 0;
+            entry[1] = 0;
+        }
+    }
+    mtx_unlock(&region->mtx);
+}
+
+void region_store_commit(RegionStore *store) {
+    mtx_lock(&store->mtx);
+    for (int i = 0; i < store->count; i++) {
+        Region *region = store->regions[i];
+        mtx_lock(&region->mtx);
+        if (region->data) {
+            RegionHeader *header = (RegionHeader *)region->data;
+            unsigned int garbage =
+                header->end - sizeof(RegionHeader) - header->live;
+            if (garbage > REGION_GROW && garbage > header->live) {
+                region_compact(store, region);
+            }
+            else {
+                msync(region->data, header->end, MS_ASYNC);
+            }
+        }
+        mtx_unlock(&region->mtx);
+    }
+    mtx_unlock(&store->mtx);
+}
+
+int region_store_size(RegionStore *store, int live) {
+    // bytes in the files, or only those still referenced when live is set
+    int result = 0;
+    mtx_lock(&store->mtx);
+    for (int i = 0; i < store->count; i++) {
+        Region *region = store->regions[i];
+        mtx_lock(&region->mtx);
+        if (region->data) {
+            RegionHeader *header = (RegionHeader *)region->data;
+            result += live ?
+                sizeof(RegionHeader) + header->live : header->end;
+        }
+        mtx_unlock(&region->mtx);
+    }
+    mtx_unlock(&store->mtx);
+    return result;
+}
+
+#else
+
+// region files are memory mapped, which is only done on posix systems
+
+int region_store_open(RegionStore *store, const char *path) {
+    return -1;
+}
+
+void region_store_close(RegionStore *store) {
+}
+
+void region_store_remove(const char *path) {
+}
+
+int region_store_save(
+    RegionStore *store, int layer, int p, int q, Voxel *voxels, int count)
+{
+    return -1;
+}
+
+Voxel *region_store_load(
+    RegionStore *store, int layer, int p, int q, int *count)
+{
+    *count = 0;
+    return 0;
+}
+
+void region_store_clear(RegionStore *store, int p, int q) {
+}
+
+void region_store_commit(RegionStore *store) {
+}
+
+int region_store_size(RegionStore *store, int live) {
+    return 0;
+}
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef _region_h_
+#define _region_h_
+
+#include "blob.h"
+#include "tinycthread.h"
+
+#define REGION_SIZE 32
+#define REGION_LAYERS 2
+
+typedef struct {
+    int x;
+    int z;
+    int fd;
+    mtx_t mtx;
+    unsigned char *data;
+    unsigned int capacity;
+} Region;
+
+typedef struct {
+    char path[256];
+    mtx_t mtx;
+    Region **regions;
+    int count;
+    int capacity;
+} RegionStore;
+
+int region_store_open(RegionStore *store, const char *path);
+void region_store_close(RegionStore *store);
+void region_store_remove(const char *path);
+int region_store_save(
+    RegionStore *store, int layer, int p, int q, Voxel *voxels, int count);
+Voxel *region_store_load(
+    RegionStore *store, int layer, int p, int q, int *count);
+void region_store_clear(RegionStore *store, int p, int q);
+void region_store_commit(RegionStore *store);
+int region_store_size(RegionStore *store, int live);
+
+#endif
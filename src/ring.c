@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <string.h>
+#include "atomic.h"
 #include "ring.h"
 
 void ring_alloc(Ring *ring, int capacity) {
@@ -32,15 +33,22 @@ int ring_size(Ring *ring) {
 
 void ring_grow(Ring *ring) {
     Ring new_ring;
-    RingEntry entry;
     ring_alloc(&new_ring, ring->capacity * 2);
-    while (ring_get(ring, &entry)) {
-        ring_put(&new_ring, &entry);
+    int size = ring_size(ring);
+    if (ring->end >= ring->start) {
+        memcpy(new_ring.data, ring->data + ring->start,
+            sizeof(RingEntry) * size);
+    }
+    else {
+        int n = ring->capacity - ring->start;
+        memcpy(new_ring.data, ring->data + ring->start,
+            sizeof(RingEntry) * n);
+        memcpy(new_ring.data + n, ring->data, sizeof(RingEntry) * ring->end);
     }
     free(ring->data);
     ring->capacity = new_ring.capacity;
-    ring->start = new_ring.start;
-    ring->end = new_ring.end;
+    ring->start = 0;
+    ring->end = size;
     ring->data = new_ring.data;
 }
 
@@ -107,3 +115,58 @@ int ring_get(Ring *ring, RingEntry *entry) {
     ring->start = (ring->start + 1) % ring->capacity;
     return 1;
 }
+
+void spsc_alloc(SpscRing *ring, int capacity) {
+    ring->mask = capacity - 1;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->write = 0;
+    ring->data = (RingEntry *)calloc(capacity, sizeof(RingEntry));
+    ring_alloc(&ring->overflow, 64);
+}
+
+void spsc_free(SpscRing *ring) {
+    free(ring->data);
+    ring_free(&ring->overflow);
+}
+
+int spsc_empty(SpscRing *ring) {
+    return ATOMIC_LOAD(&ring->head) == ATOMIC_LOAD(&ring->tail);
+}
+
+void spsc_put(SpscRing *ring, RingEntry *entry) {
+    unsigned int used = ring->write - ATOMIC_LOAD(&ring->head);
+    if (used > ring->mask || !ring_empty(&ring->overflow)) {
+        // full, the producer never waits for the consumer
+        ring_put(&ring->overflow, entry);
+        return;
+    }
+    memcpy(ring->data + (ring->write & ring->mask), entry, sizeof(RingEntry));
+    ring->write++;
+}
+
+int spsc_publish(SpscRing *ring) {
+    RingEntry entry;
+    while (!ring_empty(&ring->overflow)) {
+        unsigned int used = ring->write - ATOMIC_LOAD(&ring->head);
+        if (used > ring->mask) {
+            break;
+        }
+        ring_get(&ring->overflow, &entry);
+        memcpy(ring->data + (ring->write & ring->mask), &entry,
+            sizeof(RingEntry));
+        ring->write++;
+    }
+    ATOMIC_STORE(&ring->tail, ring->write);
+    return ring_size(&ring->overflow);
+}
+
+int spsc_get(SpscRing *ring, RingEntry *entry) {
+    unsigned int head = ring->head;
+    if (head == ATOMIC_LOAD(&ring->tail)) {
+        return 0;
+    }
+    memcpy(entry, ring->data + (head & ring->mask), sizeof(RingEntry));
+    ATOMIC_STORE(&ring->head, head + 1);
+    return 1;
+}
@@ -6,7 +6,21 @@ typedef enum {
     LIGHT,
     KEY,
     COMMIT,
-    EXIT
+    EXIT,
+    SIGN,
+    DELETE_SIGN,
+    DELETE_SIGNS,
+    DELETE_CHUNK_SIGNS,
+    DELETE_ALL_SIGNS,
+    STATE,
+    AUTH_SET,
+    AUTH_SELECT,
+    AUTH_SELECT_NONE,
+    AUTH_LOGIN,
+    BLOCKS,
+    LIGHTS,
+    ACCESS,
+    EVICT
 } RingEntryType;
 
 typedef struct {
@@ -18,6 +32,7 @@ typedef struct {
     int z;
     int w;
     int key;
+    char *data;
 } RingEntry;
 
 typedef struct {
@@ -27,6 +42,17 @@ typedef struct {
     RingEntry *data;
 } Ring;
 
+// single producer / single consumer, capacity must be a power of two;
+// puts stay private to the producer until spsc_publish
+typedef struct {
+    unsigned int mask;
+    unsigned int head;
+    unsigned int tail;
+    unsigned int write;
+    RingEntry *data;
+    Ring overflow;
+} SpscRing;
+
 void ring_alloc(Ring *ring, int capacity);
 void ring_free(Ring *ring);
 int ring_empty(Ring *ring);
@@ -41,4 +67,11 @@ void ring_put_commit(Ring *ring);
 void ring_put_exit(Ring *ring);
 int ring_get(Ring *ring, RingEntry *entry);
 
+void spsc_alloc(SpscRing *ring, int capacity);
+void spsc_free(SpscRing *ring);
+int spsc_empty(SpscRing *ring);
+void spsc_put(SpscRing *ring, RingEntry *entry);
+int spsc_publish(SpscRing *ring);
+int spsc_get(SpscRing *ring, RingEntry *entry);
+
 #endif
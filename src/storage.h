@@ -0,0 +1,28 @@
+#ifndef _storage_h_
+#define _storage_h_
+
+#include "blob.h"
+#include "map.h"
+
+#define STORAGE_BLOCKS 0
+#define STORAGE_LIGHTS 1
+
+// Where the database keeps block and light data. save, remove and commit
+// are only called from the database worker, load may be called from any
+// thread and load_range, when set, reads a rectangle of chunks at once.
+// save returns non-zero when the voxels could not be stored.
+// Maps in a range are indexed by (p - p0) * (q1 - q0 + 1) + q - q0 and may
+// be null. size counts the bytes kept outside of the database file.
+typedef struct {
+    const char *name;
+    int (*open)(char *path);
+    void (*close)();
+    int (*save)(int layer, int p, int q, Voxel *voxels, int count);
+    void (*remove)(int p, int q);
+    void (*commit)();
+    void (*load)(int layer, int p, int q, Map *map);
+    void (*load_range)(int layer, int p0, int q0, int p1, int q1, Map **maps);
+    int (*size)();
+} Storage;
+
+#endif